@@ -1,31 +1,16 @@
 #/bin/bash
 
-function compress_image()
+# Compresses every image of $1 into $2 with a single batch run of quant,
+# PNG files are read and written directly
+function compress_images()
 {
     local in=$1
     local out=$2
 
-    echo "Compressing image $in"
-
-    in="${in%.*}"
-    out="${out%.*}"
-
-    pngtopnm $in.png > $in.ppm
-
-    ../build/quant -n 8 --file $in.ppm -o $out.ppm -h 1 -w 1 | tee $out.raport
-
-    pnmtopng $out.ppm > $out.png
-
-    rm $in.ppm
-    rm $out.ppm
+    mkdir -p $out
+    ../build/quant -n 8 -h 1 -w 1 --batch $in -o $out --batch-format png | tee $out/batch.raport
 }
 
-#for image in `ls images`
-#do
-#    compress_image "images/$image" "compressed_images/$image"
-#done
+#compress_images images compressed_images
 
-for image in `ls kodim`
-do
-    compress_image "kodim/$image" "compressed_kodim_small_block/$image"
-done
+compress_images kodim compressed_kodim_small_block
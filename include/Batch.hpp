@@ -0,0 +1,52 @@
+#pragma once
+#include "Compressor.hpp"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Batch compression of many images in one process. Images are read ahead
+// by a loader thread, then each one is compressed and written by its own
+// task while the next ones load. Every task gets a team of OpenMP threads
+// from a shared budget: large images take the whole machine, small ones a
+// single thread each so many of them train at once.
+
+// Images with at least this many pixels are compressed with all threads
+const size_t LARGE_IMAGE_PIXELS = 1 << 21;
+
+struct BatchSettings {
+  Quantizers quantizer = Quantizers::LBG;
+  ColorSpaces colorSpace = ColorSpaces::SCALED;
+  int blockWidth = 2;
+  int blockHeight = 2;
+  VectorType eps = 0.000001;
+  int n = 8;
+  CompressionParameters parameters;
+  // Thread budget, 0 means all hardware threads
+  unsigned threads = 0;
+};
+
+struct BatchJob {
+  std::string input;
+  // .quant is saved directly, image formats are decompressed first
+  std::string output;
+};
+
+struct BatchResult {
+  BatchJob job;
+  CompressionRaport raport;
+  // Empty when job succeeded
+  std::string error;
+};
+
+// Runs all jobs, `onDone` is called for each finished one, one call at a
+// time, in order of completion
+void compressBatch(const std::vector<BatchJob> &jobs,
+                   const BatchSettings &settings,
+                   const std::function<void(const BatchResult &)> &onDone);
+
+// Files with one of `extensions` found in directories of `paths`, plain
+// files are taken as they are. Directory contents are sorted by name.
+std::vector<std::string>
+listImages(const std::vector<std::string> &paths,
+           const std::vector<std::string> &extensions);
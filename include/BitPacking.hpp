@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Values of `bits` bits each (at most 32) stored back to back, least
+// significant bit first. Packing and unpacking move whole 64-bit words.
+
+// Bytes needed to pack `count` values
+size_t packedSize(size_t count, unsigned bits);
+
+std::vector<uint8_t> packBits(const std::vector<size_t> &values,
+                              unsigned bits);
+std::vector<size_t> unpackBits(const uint8_t *data, size_t count,
+                               unsigned bits);
+
+// Value `i` read in place, 8 bytes starting with the one holding its first
+// bit have to be readable
+static inline size_t unpackOne(const uint8_t *data, size_t i, unsigned bits) {
+  const size_t bit = i * bits;
+  uint64_t word;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  std::memcpy(&word, data + bit / 8, sizeof(word));
+#else
+  word = 0;
+  for (size_t k = 0; k < sizeof(word); k++)
+    word |= (uint64_t)data[bit / 8 + k] << (8 * k);
+#endif
+  return (word >> (bit % 8)) & (((uint64_t)1 << bits) - 1);
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// ByteBlocks is training set kept as raw 0-255 components. Every block
+// occupies `stride` bytes (dim rounded up to 16) so distance kernels can
+// process whole SSE registers, padding is always zero.
+
+const static size_t BYTE_BLOCK_ALIGN = 16;
+
+struct ByteBlocks {
+  ByteBlocks() = default;
+  ByteBlocks(size_t count, size_t dim)
+      : dim(dim),
+        stride((dim + BYTE_BLOCK_ALIGN - 1) / BYTE_BLOCK_ALIGN *
+               BYTE_BLOCK_ALIGN),
+        data(count * stride) {}
+
+  size_t size() const { return stride ? data.size() / stride : 0; }
+  uint8_t *operator[](size_t i) { return data.data() + i * stride; }
+  const uint8_t *operator[](size_t i) const { return data.data() + i * stride; }
+
+  size_t dim = 0;
+  size_t stride = 0;
+  std::vector<uint8_t> data;
+};
+
+// Squared euclidean distance between two blocks of given stride.
+static inline uint32_t squaredDistance(const uint8_t *a, const uint8_t *b,
+                                       size_t stride) {
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  for (size_t i = 0; i < stride; i += BYTE_BLOCK_ALIGN) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero),
+                               _mm_unpacklo_epi8(y, zero));
+    __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero),
+                               _mm_unpackhi_epi8(y, zero));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(acc);
+#else
+  uint32_t res = 0;
+  for (size_t i = 0; i < stride; i++) {
+    int32_t d = (int32_t)a[i] - (int32_t)b[i];
+    res += d * d;
+  }
+  return res;
+#endif
+}
+
+// Index of block from `blocks` nearest to `x`, distance is stored in
+// `distance`. Four candidates are processed at once so horizontal sums
+// are shared between them.
+static inline size_t nearestBlock(const uint8_t *x, const ByteBlocks &blocks,
+                                  uint32_t &distance) {
+  const size_t stride = blocks.stride;
+  size_t found = 0;
+  uint32_t best = UINT32_MAX;
+  size_t c = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  // Widened query, stride never exceeds 27 components rounded up
+  __m128i xs[4];
+  const size_t chunks = std::min<size_t>(stride / BYTE_BLOCK_ALIGN, 2);
+  for (size_t k = 0; k < chunks; k++) {
+    __m128i v = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(x + k * BYTE_BLOCK_ALIGN));
+    xs[2 * k] = _mm_unpacklo_epi8(v, zero);
+    xs[2 * k + 1] = _mm_unpackhi_epi8(v, zero);
+  }
+
+  for (; chunks * BYTE_BLOCK_ALIGN == stride && c + 4 <= blocks.size();
+       c += 4) {
+    __m128i acc[4];
+    for (size_t m = 0; m < 4; m++) {
+      const uint8_t *y = blocks[c + m];
+      acc[m] = _mm_setzero_si128();
+      for (size_t k = 0; k < chunks; k++) {
+        __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(y + k * BYTE_BLOCK_ALIGN));
+        __m128i lo = _mm_sub_epi16(xs[2 * k], _mm_unpacklo_epi8(v, zero));
+        __m128i hi = _mm_sub_epi16(xs[2 * k + 1], _mm_unpackhi_epi8(v, zero));
+        acc[m] = _mm_add_epi32(acc[m], _mm_madd_epi16(lo, lo));
+        acc[m] = _mm_add_epi32(acc[m], _mm_madd_epi16(hi, hi));
+      }
+    }
+    // Transpose and add, lane m holds distance to candidate c + m
+    __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(acc[0], acc[1]),
+                                _mm_unpackhi_epi32(acc[0], acc[1]));
+    __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(acc[2], acc[3]),
+                                _mm_unpackhi_epi32(acc[2], acc[3]));
+    __m128i sum = _mm_add_epi32(_mm_unpacklo_epi64(s01, s23),
+                                _mm_unpackhi_epi64(s01, s23));
+    alignas(16) uint32_t d[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(d), sum);
+    for (size_t m = 0; m < 4; m++)
+      if (d[m] < best) {
+        best = d[m];
+        found = c + m;
+      }
+  }
+#endif
+  for (; c < blocks.size(); c++) {
+    uint32_t d = squaredDistance(x, blocks[c], stride);
+    if (d < best) {
+      best = d;
+      found = c;
+    }
+  }
+  distance = best;
+  return found;
+}
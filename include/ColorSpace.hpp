@@ -2,13 +2,23 @@
 
 #include <memory>
 #include "RGBImage.hpp"
+#include "VectorOperations.hpp"
 
-enum class ColorSpaces { NORMAL, SCALED, CIE1931 };
+// YCBCR420 codes full resolution luma and chroma subsampled 2x in both
+// directions with separate codebooks.
+enum class ColorSpaces { NORMAL, SCALED, CIE1931, YCBCR, LAB, YCBCR420 };
 
 class ColorSpace {
  public:
   virtual RGBDouble RGBtoColorSpace(const RGB &);
   virtual RGB colorSpaceToRGB(const RGBDouble &);
+  // Span versions convert `count` pixels with one call, components of
+  // consecutive pixels are stored one after another. By default they go
+  // pixel by pixel.
+  virtual void RGBSpanToColorSpace(const RGB *in, size_t count,
+                                   VectorType *out);
+  virtual void colorSpaceSpanToRGB(const VectorType *in, size_t count,
+                                   RGB *out);
   virtual ~ColorSpace() = default;
 };
 
@@ -1,14 +1,20 @@
 #pragma once
+#include "ByteBlocks.hpp"
 #include "ColorSpace.hpp"
 #include "Quantizer.hpp"
 #include "VectorOperations.hpp"
 
 #include <chrono>
+#include <iosfwd>
 #include <memory>
 
 class CompressionRaport {
  public:
+  // Mean squared error per component
   VectorType distortion;
+  VectorType psnr;
+  VectorType ssim;
+  VectorType msSsim;
   float bitsPerPixel;
   size_t uncompressedSize;
   size_t compressedSize;
@@ -17,34 +23,115 @@ class CompressionRaport {
                                   const CompressionRaport &raport);
 };
 
+// Options of compression on top of quantizer ones
+struct CompressionParameters : QuantizerParameters {
+  // Order codebook as a binary tree and store indices as bit-planes, so a
+  // prefix of .quant file decodes to a coarser image
+  bool progressive = false;
+  // Targets of compressRatePoints, 0 means none. Splitting stops at first
+  // level with PSNR at least targetPsnr, or at the last one not above
+  // targetBitsPerPixel.
+  VectorType targetPsnr = 0;
+  float targetBitsPerPixel = 0;
+};
+
 class CompressedImage {
  public:
   CompressedImage() = default;
   void saveToFile(const std::string &path);
   void loadFromFile(const std::string &path);
+  void save(std::ostream &) const;
+  void load(std::istream &);
   size_t sizeInBits();
 
   static std::pair<CompressedImage, CompressionRaport> compress(
-      const RGBImage &image, Quantizers quantizer, ColorSpaces colorSpace, 
-      int blockWidth, int blockHeight, VectorType eps, int N);
+      const RGBView &image, Quantizers quantizer, ColorSpaces colorSpace,
+      int blockWidth, int blockHeight, VectorType eps, int N,
+      const CompressionParameters &parameters = CompressionParameters());
+  // Compression at every bit per codevector level in `levels` from one
+  // splitting run, snapshot is taken after each splitting phase. With a
+  // target set only the picked level is returned.
+  static std::vector<std::pair<CompressedImage, CompressionRaport>>
+  compressRatePoints(
+      const RGBView &image, Quantizers quantizer, ColorSpaces colorSpace,
+      int blockWidth, int blockHeight, VectorType eps,
+      const std::vector<int> &levels,
+      const CompressionParameters &parameters = CompressionParameters());
 
   static RGBImage decompress(const CompressedImage &);
+  // Decodes rows [yBegin, yEnd) of image into `out`
+  void decompressRows(size_t yBegin, size_t yEnd, RGB *out) const;
+  // Decodes w x h pixels with top left corner at (x, y) into `out`, rows
+  // of `out` are `stride` bytes apart (0 when packed)
+  void decompressRegion(size_t x, size_t y, size_t w, size_t h, RGB *out,
+                        size_t stride = 0) const;
 
  //private:
   std::vector<CharVector> codeVectors;
   std::vector<size_t> assignedCodeVector;
+  // Chroma codebook, used only by YCBCR420 where codeVectors hold luma
+  std::vector<CharVector> chromaCodeVectors;
+  std::vector<size_t> chromaAssignedCodeVector;
   size_t xSize, ySize;
   size_t blockWidth, blockHeight;
   ColorSpaces colorSpace;
   Quantizers quantizer;
+  // Codebooks are tree ordered and saved as progressive stream
+  bool progressive = false;
+};
+
+// Codebook of one image plane as seen by decoder: codevectors laid out
+// contiguously and index of every block, either decoded or bit-packed
+struct CodebookSource {
+  const char *codeVectors = nullptr;
+  const size_t *indices = nullptr;
+  // Used when indices are null, has to be readable a word past the end
+  const uint8_t *packedIndices = nullptr;
+  unsigned bitsPerIndex = 0;
+  // Indices may cover only a window of block grid starting at block column
+  // blockX and block row blockY, `stride` indices per row (0 is whole grid)
+  size_t blockX = 0;
+  size_t blockY = 0;
+  size_t stride = 0;
 };
 
+// Decodes window [xBegin, xEnd) x [yBegin, yEnd) of image into `out`,
+// chroma is used only by YCBCR420. Sources have to cover blocks of the
+// window. Rows of `out` are `outStride` bytes apart, 0 means packed.
+void decodeRegion(ColorSpaces colorSpace, size_t xSize, size_t blockWidth,
+                  size_t blockHeight, const CodebookSource &main,
+                  const CodebookSource &chroma, size_t xBegin, size_t yBegin,
+                  size_t xEnd, size_t yEnd, RGB *out, size_t outStride = 0);
+
+// Bits needed to store index of one of n codevectors
+size_t bitsPerIndex(size_t n);
+
 std::vector<CharVector> vectorsToCharVectorsColorSpaced(
     const std::vector<Vector> &vectors, const ColorSpacePtr &cs);
-std::vector<Vector> getBlocksAsVectorsFromImage(const RGBImage &image, int w,
+std::vector<Vector> getBlocksAsVectorsFromImage(const RGBView &image, int w,
                                                 int h, const ColorSpacePtr &);
+ByteBlocks getBlocksAsBytesFromImage(const RGBView &image, int w, int h);
+ByteBlocks getBlocksAsBytesFromPlane(const uint8_t *plane, size_t xSize,
+                                     size_t ySize, size_t channels, int w,
+                                     int h, size_t stride = 0);
+
+// Permutes codebook so similar codevectors get nearby indices (greedy
+// nearest neighbour path from the darkest one, or order by brightness
+// for codebooks above 4096 codevectors) and remaps indices
+void reorderCodeVectors(std::vector<CharVector> &codeVectors,
+                        std::vector<size_t> &assignedCodeVector);
+// Permutes codebook so leading bits of an index select a subtree of
+// similar codevectors, every node splits its codevectors in halves along
+// their principal axis. Remaps indices.
+void treeOrderCodeVectors(std::vector<CharVector> &codeVectors,
+                          std::vector<size_t> &assignedCodeVector);
 
 RGBImage getImageFromVectors(const std::vector<CharVector> &blocks, int xSize,
                              int ySize, int w, int h);
+// Decoding straight from codebook and indices, without copy of codevector
+// per block
+RGBImage getImageFromCodeVectors(const std::vector<CharVector> &codeVectors,
+                                 const std::vector<size_t> &assignedCodeVector,
+                                 int xSize, int ySize, int w, int h);
 std::tuple<std::vector<Vector>, std::vector<size_t>, VectorType> quantize(
     const std::vector<Vector> &trainingSet, size_t n, VectorType eps);
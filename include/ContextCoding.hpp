@@ -0,0 +1,30 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Codevector indices of a block grid `width` blocks wide coded with
+// adaptive binary range coder. Every index is predicted from its left and
+// top neighbours: a flag tells whether it repeats left index, then
+// whether it repeats top one, only otherwise index is coded explicitly.
+
+void encodeIndexGrid(const std::vector<size_t> &indices, size_t width,
+                     size_t alphabet, std::vector<uint8_t> &out);
+// Decodes `count` indices from `size` bytes of data starting at `pos`,
+// advances `pos`. Stream running past data throws std::runtime_error.
+std::vector<size_t> decodeIndexGrid(const uint8_t *data, size_t size,
+                                    size_t &pos, size_t count, size_t width,
+                                    size_t alphabet);
+
+// Bit-planes of indices, plane 0 holds their most significant bits. Every
+// plane is coded on its own given the previous ones, with leading bits of
+// the block and of its left and top neighbours as context, so any number
+// of leading planes decodes to leading bits of every index.
+
+// Appends plane `plane` of indices `bits` wide as a range coded stream
+void encodeIndexPlane(const std::vector<size_t> &indices, size_t width,
+                      unsigned bits, unsigned plane, std::vector<uint8_t> &out);
+// Decodes plane `plane` from `size` bytes of data, `prefixes` hold
+// `plane` leading bits of every index and get the next one appended
+void decodeIndexPlane(const uint8_t *data, size_t size, size_t width,
+                      unsigned plane, std::vector<size_t> &prefixes);
@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Static order-0 rANS coder. Frequency table is computed per call and
+// stored in front of the stream, four interleaved states let decoding
+// of consecutive symbols overlap.
+
+// Largest alphabet coder accepts
+const size_t RANS_MAX_ALPHABET = 1 << 14;
+
+// Encodes `symbols`, all smaller than `alphabet`, appending them to `out`
+void ransEncode(const std::vector<uint32_t> &symbols, size_t alphabet,
+                std::vector<uint8_t> &out);
+// Decodes `count` symbols from `size` bytes of data starting at `pos`,
+// advances `pos`. Malformed data throws std::runtime_error.
+std::vector<uint32_t> ransDecode(const uint8_t *data, size_t size,
+                                 size_t &pos, size_t count, size_t alphabet);
+
+// LEB128 variable length integers
+void writeVarint(uint64_t x, std::vector<uint8_t> &out);
+uint64_t readVarint(const uint8_t *data, size_t size, size_t &pos);
@@ -0,0 +1,43 @@
+#pragma once
+#include "Netpbm.hpp"
+
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Uncompressed image formats, picked by file extension. Anything not
+// recognised as PNG or QOI is read as Netpbm.
+enum class ImageFormat { NETPBM, PNG, QOI };
+
+ImageFormat imageFormat(const std::string &path);
+// True when `path` ends with `ext`, which includes the leading dot
+bool hasExtension(const std::string &path, const std::string &ext);
+// Extensions of all readable images, with leading dot
+std::vector<std::string> imageExtensions();
+
+// Image read from file. Netpbm stays mapped and may be used in place, PNG
+// and QOI are decoded into owned pixels.
+class ImageFile {
+ public:
+  explicit ImageFile(const std::string &path);
+  ImageFile(const std::string &path, ImageFormat format);
+
+  const RGBView &view() const { return pixels; }
+
+ private:
+  std::unique_ptr<MappedNetpbmFile> netpbm;
+  RGBImage decoded;
+  RGBView pixels;
+};
+
+// Rest of stream, read in big chunks
+std::vector<uint8_t> readStream(std::istream &in);
+// Image in format of extension of `path` read from stream. Netpbm is read
+// as it arrives, PNG and QOI are buffered whole first.
+RGBImage readImage(std::istream &in, const std::string &path);
+// Format is picked by extension of `path`, Netpbm ones are written as PGM
+// (.pgm), PAM (.pam) or PPM (anything else)
+void writeImage(const RGBView &image, std::ostream &out,
+                const std::string &path);
+void saveImage(const RGBView &image, const std::string &path);
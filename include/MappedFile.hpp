@@ -0,0 +1,21 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Whole file mapped read-only into memory, pages are read on first touch.
+// Empty file gives null data.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return static_cast<const uint8_t *>(mapping); }
+  size_t size() const { return length; }
+
+ private:
+  void *mapping = nullptr;
+  size_t length = 0;
+};
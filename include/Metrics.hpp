@@ -0,0 +1,16 @@
+#pragma once
+#include "Compressor.hpp"
+
+// Quality of compressed image measured against the original. SSIM and
+// MS-SSIM are computed on luma with 8x8 windows placed every 4 pixels.
+struct QualityMetrics {
+  VectorType mse = 0;
+  VectorType psnr = 0;
+  VectorType ssim = 0;
+  VectorType msSsim = 0;
+};
+
+// Compressed image is decoded band by band in parallel, only the half
+// resolution luma needed by MS-SSIM is kept for the whole image.
+QualityMetrics measureQuality(const RGBView &original,
+                              const CompressedImage &compressed);
@@ -0,0 +1,52 @@
+#pragma once
+#include "MappedFile.hpp"
+#include "RGBImage.hpp"
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Netpbm images: PBM, PGM and PPM in plain (P1-P3) and raw (P4-P6) form,
+// and PAM (P7) of tuple types BLACKANDWHITE, GRAYSCALE and RGB, with or
+// without alpha. Any maxval up to 65535 is accepted, samples are scaled to
+// 8 bits, gray is replicated to RGB and alpha is dropped. Malformed files
+// throw std::runtime_error.
+
+enum class NetpbmFormat { PGM, PPM, PAM };
+
+// Image parsed from data kept by caller. Raw 8 bit RGB raster (P6 or PAM
+// RGB with maxval 255) is used in place, so data has to outlive the image.
+// Other rasters are converted once into an owned buffer.
+class NetpbmImage {
+ public:
+  NetpbmImage(const uint8_t *data, size_t size);
+  NetpbmImage(const NetpbmImage &) = delete;
+  NetpbmImage &operator=(const NetpbmImage &) = delete;
+
+  const RGBView &view() const { return pixels; }
+  bool inPlace() const { return converted.empty(); }
+
+ private:
+  std::vector<RGB> converted;
+  RGBView pixels;
+};
+
+// Netpbm file mapped into memory, see NetpbmImage
+class MappedNetpbmFile {
+ public:
+  explicit MappedNetpbmFile(const std::string &path);
+
+  const RGBView &view() const { return image.view(); }
+
+ private:
+  MappedFile file;
+  NetpbmImage image;
+};
+
+// Image read from stream as it arrives, raw 8 bit RGB raster goes straight
+// into pixels of the image
+RGBImage readNetpbm(std::istream &in);
+// PGM keeps only luma (BT.601 weights)
+void writeNetpbm(const RGBView &image, std::ostream &out,
+                 NetpbmFormat format = NetpbmFormat::PPM);
@@ -0,0 +1,29 @@
+#pragma once
+#include "VectorOperations.hpp"
+
+// Nearest neighbour search in principal component basis of given points.
+// Points are kept sorted by their first coefficient, search walks outwards
+// from the query and rejects candidates on first few coefficients, full
+// distance in original space is computed only for survivors.
+
+class PCASearch {
+ public:
+  PCASearch(size_t dim, const std::vector<Vector> &);
+  size_t nearestNeighbour(const Vector &pt) const;
+  // Hint is index of a point likely to be near, it tightens the bound
+  // before the walk starts. Distance is squared euclidean.
+  size_t nearestNeighbour(const Vector &pt, size_t hint,
+                          VectorType &distance) const;
+
+ private:
+  void project(const VectorType *pt, VectorType *res) const;
+
+  size_t dim;
+  size_t prefix;
+  std::vector<VectorType> basis;   // leading principal axes as rows
+  std::vector<VectorType> leading; // leading coefficients of sorted points
+  std::vector<VectorType> points;  // sorted points in original space
+  std::vector<VectorType> firstCoefficient;
+  std::vector<size_t> order;     // original index of sorted point
+  std::vector<size_t> position;  // sorted position of original point
+};
@@ -0,0 +1,11 @@
+#pragma once
+#include "RGBImage.hpp"
+
+#include <cstdint>
+#include <iosfwd>
+
+// PNG through libpng's simplified API. Any bit depth, palette and gray
+// image is read as 8 bit sRGB, alpha is composed onto black. Malformed
+// files throw std::runtime_error.
+RGBImage readPng(const uint8_t *data, size_t size);
+void writePng(const RGBView &image, std::ostream &out);
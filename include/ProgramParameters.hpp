@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include <string>
+#include <vector>
 
 struct ProgramParameters {
   int n;
@@ -8,11 +9,27 @@ struct ProgramParameters {
   int height;
   float eps;
   bool raport;
+  bool progressive;
   bool show;
   int quantizer;
   int colorspace;
+  int search;
+  int split;
+  int acceleration;
+  unsigned seed;
+  int codevectors;
   std::string file;
   std::string saveto;
+  // Formats overriding extensions, needed for "-" (stdin and stdout)
+  std::string from;
+  std::string to;
+  std::string region;
+  std::string rates;
+  float targetPsnr;
+  float targetBitsPerPixel;
+  std::vector<std::string> batch;
+  std::string batchFormat;
+  unsigned threads;
 };
 
 ProgramParameters *getParams();
@@ -0,0 +1,11 @@
+#pragma once
+#include "RGBImage.hpp"
+
+#include <cstdint>
+#include <iosfwd>
+
+// QOI ("Quite OK Image") codec, lossless and an order of magnitude faster
+// than PNG. RGBA files are read with alpha dropped, RGB is written.
+// Malformed files throw std::runtime_error.
+RGBImage readQoi(const uint8_t *data, size_t size);
+void writeQoi(const RGBView &image, std::ostream &out);
@@ -0,0 +1,91 @@
+#pragma once
+/* C interface of the library. Images are 8 bit RGB triples kept by the
+ * caller, rows are `stride` bytes apart. Compressed images are .quant
+ * files held in memory. Nothing touches the file system or global state,
+ * functions may be called from several threads at once. */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum quant_status {
+  QUANT_OK = 0,
+  QUANT_INVALID_ARGUMENT,
+  QUANT_CORRUPT_DATA,
+  QUANT_OUT_OF_MEMORY,
+  QUANT_INTERNAL_ERROR
+} quant_status;
+
+/* Values match enums of the C++ interface */
+typedef enum quant_color_space {
+  QUANT_NORMAL = 0,
+  QUANT_SCALED,
+  QUANT_CIE1931,
+  QUANT_YCBCR,
+  QUANT_LAB,
+  QUANT_YCBCR420
+} quant_color_space;
+
+typedef struct quant_options {
+  quant_color_space color_space;
+  /* At most 256 each */
+  uint32_t block_width;
+  uint32_t block_height;
+  /* Codebook has 2^bits codevectors unless code_vectors is not 0, at most
+   * 2^24 either way */
+  uint32_t bits;
+  uint64_t code_vectors;
+  double eps;
+  /* Prefix of progressive stream decodes to a coarser image */
+  int progressive;
+  /* OpenMP threads of the call, 0 keeps current setting */
+  int threads;
+} quant_options;
+
+typedef struct quant_info {
+  uint32_t width;
+  uint32_t height;
+  quant_color_space color_space;
+  uint32_t block_width;
+  uint32_t block_height;
+} quant_info;
+
+/* Quality of compressed image, filled by quant_compress on request */
+typedef struct quant_stats {
+  double psnr;
+  double ssim;
+  double bits_per_pixel;
+} quant_stats;
+
+/* Defaults of the command line tool: SCALED, 2x2 blocks, 2^8 codevectors */
+void quant_default_options(quant_options *options);
+
+/* Compresses width x height pixels, on success *out holds .quant data of
+ * *out_size bytes to be released with quant_free. stats may be NULL. */
+quant_status quant_compress(const uint8_t *pixels, size_t width,
+                            size_t height, size_t stride,
+                            const quant_options *options, uint8_t **out,
+                            size_t *out_size, quant_stats *stats);
+
+quant_status quant_get_info(const uint8_t *data, size_t size,
+                            quant_info *info);
+
+/* Decodes whole image into pixels, which must hold info.height rows */
+quant_status quant_decompress(const uint8_t *data, size_t size,
+                              uint8_t *pixels, size_t stride);
+
+/* Decodes w x h pixels with top left corner at (x, y), only tiles covering
+ * the region are entropy decoded */
+quant_status quant_decompress_region(const uint8_t *data, size_t size,
+                                     size_t x, size_t y, size_t w, size_t h,
+                                     uint8_t *pixels, size_t stride);
+
+void quant_free(uint8_t *data);
+
+const char *quant_status_string(quant_status status);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,145 @@
+#pragma once
+#include "Compressor.hpp"
+#include "MappedFile.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Binary .quant layout. File starts with QuantHeader followed by one
+// SectionHeader per codebook: main one, then chroma for YCbCr 4:2:0. Data
+// of sections lives at offsets aligned to QUANT_ALIGNMENT and is followed
+// by at least a word of zero padding, so raw codebooks and bit-packed
+// indices can be used in place from a memory mapped file. All numbers are
+// little endian.
+//
+// Entropy coded indices are split into tiles of tileWidth x tileHeight
+// blocks, each coded on its own, so a region is decoded from the tiles it
+// touches. Index data then starts with table of tiles + 1 offsets
+// (uint64_t, relative to indexOffset), tiles go in row-major order.
+// Bit-packed indices are stored for whole grid, they are random access
+// anyway.
+//
+// Progressive sections have codebook ordered as binary tree, leading bits
+// of an index pick a subtree of similar codevectors. Their index data is
+// table of (begin, end) file offsets of bit-planes, planes of all sections
+// follow codebooks and tables interleaved from the most significant one.
+// File cut anywhere after the tables still decodes: blocks whose indices
+// miss trailing bits get mean of codevectors in their subtree.
+
+const size_t QUANT_ALIGNMENT = 64;
+const char QUANT_MAGIC[8] = {'Q', 'U', 'A', 'N', 'T', 'B', 'I', 'N'};
+const uint32_t QUANT_VERSION = 2;
+// Widest index a section can have
+const unsigned QUANT_MAX_INDEX_BITS = 24;
+// Default tile size in blocks
+const uint32_t QUANT_TILE_BLOCKS = 64;
+
+enum class CodebookCoding : uint32_t {
+  RAW,
+  // Differences between consecutive codevectors, rANS coded
+  DELTA_RANS
+};
+
+enum class IndexCoding : uint32_t {
+  // bitsPerIndex bits per index
+  PACKED,
+  // Order-0 rANS
+  RANS,
+  // Predicted from left and top neighbours, range coded
+  CONTEXT,
+  // Range coded bit-planes, most significant first
+  PROGRESSIVE
+};
+
+struct QuantHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t colorSpace;
+  uint64_t xSize;
+  uint64_t ySize;
+  uint32_t blockWidth;
+  uint32_t blockHeight;
+  uint32_t sections;
+  uint32_t reserved[5];
+};
+
+struct SectionHeader {
+  uint32_t codebookCoding;
+  uint32_t indexCoding;
+  uint64_t codeVectors;
+  uint64_t codeVectorSize;
+  // Blocks of section's plane
+  uint64_t gridWidth;
+  uint64_t gridHeight;
+  uint64_t codebookOffset;
+  uint64_t codebookSize;
+  uint64_t indexOffset;
+  uint64_t indexSize;
+  uint32_t tileWidth;
+  uint32_t tileHeight;
+};
+
+static_assert(sizeof(QuantHeader) == 64, "QuantHeader layout");
+static_assert(sizeof(SectionHeader) == 80, "SectionHeader layout");
+
+void writeQuantFile(const CompressedImage &image, std::ostream &file);
+
+// Read-only view of .quant file kept in memory. Constructor checks only
+// headers, sections are decoded when they are asked for. Data has to
+// outlive the view.
+class QuantView {
+ public:
+  QuantView(const uint8_t *data, size_t size);
+
+  const QuantHeader &header() const { return head; }
+  size_t sections() const { return sectionHeaders.size(); }
+  const SectionHeader &section(size_t i) const { return sectionHeaders[i]; }
+  // Leading bits of indices present, less than bitsPerIndex only for
+  // truncated progressive file
+  size_t planes(size_t section) const;
+
+  // Codebook and indices of section for decoder. They point into data when
+  // stored raw and bit-packed, otherwise they are decoded into storage.
+  CodebookSource source(size_t section, std::vector<char> &codebookStorage,
+                        std::vector<size_t> &indexStorage) const;
+
+  RGBImage decompress() const;
+  // Decodes w x h pixels with top left corner at (x, y), only tiles
+  // covering the region are entropy decoded
+  RGBImage decompressRegion(size_t x, size_t y, size_t w, size_t h) const;
+  // Same into caller's buffer, rows of `out` are `stride` bytes apart (0
+  // when packed)
+  void decompressRegion(size_t x, size_t y, size_t w, size_t h, RGB *out,
+                        size_t stride = 0) const;
+  CompressedImage toCompressedImage() const;
+
+ private:
+  const char *codebook(size_t section, std::vector<char> &storage) const;
+  // Indices of tile, tiles are numbered row-major
+  std::vector<size_t> tile(size_t section, size_t k) const;
+  // Source covering block window [blockXBegin, blockXEnd) x [blockYBegin,
+  // blockYEnd), rounded out to whole tiles
+  CodebookSource source(size_t section, size_t blockXBegin,
+                        size_t blockYBegin, size_t blockXEnd,
+                        size_t blockYEnd, std::vector<char> &codebookStorage,
+                        std::vector<size_t> &indexStorage) const;
+
+  const uint8_t *data;
+  size_t size;
+  QuantHeader head;
+  std::vector<SectionHeader> sectionHeaders;
+};
+
+// .quant file mapped into memory, loading touches only headers
+class MappedQuantFile {
+ public:
+  explicit MappedQuantFile(const std::string &path);
+
+  const QuantView &view() const { return quantView; }
+
+ private:
+  MappedFile file;
+  QuantView quantView;
+};
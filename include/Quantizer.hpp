@@ -1,20 +1,59 @@
 #pragma once
+#include "ByteBlocks.hpp"
 #include "VectorOperations.hpp"
 
+#include <functional>
 #include <memory>
 #include <tuple>
 #include <thread>
 
 enum class Quantizers { LBG, MEDIAN_CUT, LBG_MEDIAN_CUT, ABC };
 
+// DEFAULT is KDTree for double vectors and exhaustive SIMD search for bytes,
+// PCA prunes candidates on leading principal coefficients.
+enum class SearchMethods { DEFAULT, PCA };
+
+// SCALE moves children along codevector itself (1 +- 0.2), PRINCIPAL along
+// principal axis of the cell.
+enum class SplitMethods { SCALE, PRINCIPAL };
+
+// OVER_RELAXATION extrapolates centroid movement of every LBG iteration,
+// falling back to plain step whenever distortion grows.
+enum class Accelerations { NONE, OVER_RELAXATION };
+
+struct QuantizerParameters {
+  SearchMethods search = SearchMethods::DEFAULT;
+  SplitMethods split = SplitMethods::SCALE;
+  Accelerations acceleration = Accelerations::NONE;
+  // Size of codebook, when 0 it is 2^n. Otherwise last splitting phase
+  // splits only cells with the biggest distortion.
+  size_t codeVectors = 0;
+  // Seed of random generator used when reseeding empty cells
+  unsigned seed = 0;
+  // Called after initial codevector and after every splitting phase with
+  // codebook so far (in training set's domain, not rounded to bytes),
+  // assignment and distortion. Returning false stops splitting there.
+  std::function<bool(const std::vector<Vector> &, const std::vector<size_t> &,
+                     VectorType)>
+      onSplit;
+};
+
 class AbstractQuantizer {
  public:
   virtual std::tuple<std::vector<Vector>, std::vector<size_t>, VectorType>
   quantize(const std::vector<Vector> &trainingSet, size_t n,
            VectorType eps) = 0;
+
+  // Integer domain variant, by default it goes through the double path.
+  virtual std::tuple<std::vector<CharVector>, std::vector<size_t>, VectorType>
+  quantize(const ByteBlocks &trainingSet, size_t n, VectorType eps);
   virtual ~AbstractQuantizer() = default;
 };
 
 typedef std::unique_ptr<AbstractQuantizer> QuantizerPtr;
 
-QuantizerPtr getQuantizer(Quantizers);
+// Rounds codevectors of byte training set the way quantize does
+std::vector<CharVector> toCharVectors(const std::vector<Vector> &vectors);
+
+QuantizerPtr getQuantizer(
+    Quantizers, const QuantizerParameters &parameters = QuantizerParameters());
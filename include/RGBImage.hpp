@@ -1,4 +1,5 @@
 #pragma once
+#include <array>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -19,5 +20,25 @@ class RGBImage {
   void saveToFile(const std::string &path);
   size_t sizeInBytes() const;
   std::vector<RGB> img;
-  int xSize, ySize;
+  int xSize = 0, ySize = 0;
+};
+
+// Non-owning view of RGB pixels kept by caller, row y starts `stride`
+// bytes after row y - 1. Compression reads images only through it.
+struct RGBView {
+  RGBView(const RGB *pixels, size_t xSize, size_t ySize, size_t stride)
+      : pixels(pixels), xSize(xSize), ySize(ySize), stride(stride) {}
+  RGBView(const RGBImage &image)
+      : RGBView(image.img.data(), image.xSize, image.ySize,
+                image.xSize * sizeof(RGB)) {}
+
+  const RGB *row(size_t y) const {
+    return reinterpret_cast<const RGB *>(
+        reinterpret_cast<const char *>(pixels) + y * stride);
+  }
+  size_t sizeInBytes() const { return xSize * ySize * sizeof(RGB); }
+
+  const RGB *pixels;
+  size_t xSize, ySize;
+  size_t stride;
 };
@@ -109,3 +109,12 @@ static inline VectorType norm(const Vector &v) {
   for (auto x : v) res += x * x;
   return res;
 }
+
+static inline VectorType squaredDistance(const Vector &lhs, const Vector &rhs) {
+  VectorType res = 0.0;
+  for (size_t i = 0; i < lhs.size(); i++) {
+    VectorType d = lhs[i] - rhs[i];
+    res += d * d;
+  }
+  return res;
+}
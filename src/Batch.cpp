@@ -0,0 +1,187 @@
+#include "Batch.hpp"
+#include "ImageIO.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <dirent.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Threads available to tasks, a task waits until its whole team is free
+class ThreadBudget {
+ public:
+  explicit ThreadBudget(unsigned threads) : available(threads) {}
+
+  void acquire(unsigned threads) {
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock, [&]() { return available >= threads; });
+    available -= threads;
+  }
+
+  void release(unsigned threads) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      available += threads;
+    }
+    released.notify_all();
+  }
+
+ private:
+  std::mutex mutex;
+  std::condition_variable released;
+  unsigned available;
+};
+
+// Loaded images waiting for compression, loader blocks when `capacity` of
+// them are waiting
+class ImageQueue {
+ public:
+  explicit ImageQueue(size_t capacity) : capacity(capacity) {}
+
+  void push(std::unique_ptr<ImageFile> image, std::string error) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&]() { return queue.size() < capacity; });
+    queue.emplace_back(std::move(image), std::move(error));
+    changed.notify_all();
+  }
+
+  std::pair<std::unique_ptr<ImageFile>, std::string> pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&]() { return !queue.empty(); });
+    auto res = std::move(queue.front());
+    queue.pop_front();
+    changed.notify_all();
+    return res;
+  }
+
+ private:
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::pair<std::unique_ptr<ImageFile>, std::string>>
+      queue;
+  const size_t capacity;
+};
+
+void compressBatch(const std::vector<BatchJob> &jobs,
+                   const BatchSettings &settings,
+                   const std::function<void(const BatchResult &)> &onDone) {
+  unsigned threads = settings.threads;
+  if (!threads)
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  // Loader stays a little ahead of compression, so reading of the next
+  // images overlaps with training of the current ones
+  ImageQueue loaded(threads + 1);
+  std::thread loader([&]() {
+    for (const auto &job : jobs) {
+      try {
+        loaded.push(std::unique_ptr<ImageFile>(
+                        new ImageFile(job.input)),
+                    "");
+      } catch (const std::exception &e) {
+        loaded.push(nullptr, e.what());
+      }
+    }
+  });
+
+  ThreadBudget budget(threads);
+  std::mutex reportMutex;
+  auto report = [&](const BatchResult &result) {
+    std::lock_guard<std::mutex> lock(reportMutex);
+    onDone(result);
+  };
+
+  // Workers take images in order and reserve their teams while holding
+  // dispatch lock, so a large image waiting for the whole budget is not
+  // overtaken by small ones
+  std::mutex dispatchMutex;
+  size_t next = 0;
+  auto work = [&]() {
+    for (;;) {
+      std::unique_lock<std::mutex> dispatch(dispatchMutex);
+      if (next == jobs.size())
+        return;
+      const size_t k = next++;
+      auto image = loaded.pop();
+      if (!image.first) {
+        dispatch.unlock();
+        report({jobs[k], CompressionRaport(), image.second});
+        continue;
+      }
+      // Small images share the machine, unless there are too few of them
+      // left to keep it busy
+      const unsigned remaining =
+          (unsigned)std::min<size_t>(jobs.size() - k, threads);
+      const RGBView &pixels = image.first->view();
+      const unsigned team = pixels.xSize * pixels.ySize >= LARGE_IMAGE_PIXELS
+                                ? threads
+                                : std::max(threads / remaining, 1u);
+      budget.acquire(team);
+      dispatch.unlock();
+
+#ifdef _OPENMP
+      omp_set_num_threads(team);
+#endif
+      BatchResult result{jobs[k], CompressionRaport(), ""};
+      try {
+        auto compressed = CompressedImage::compress(
+            pixels, settings.quantizer, settings.colorSpace,
+            settings.blockWidth, settings.blockHeight, settings.eps,
+            settings.n, settings.parameters);
+        image.first.reset();
+        result.raport = compressed.second;
+        if (hasExtension(jobs[k].output, ".quant"))
+          compressed.first.saveToFile(jobs[k].output);
+        else
+          CompressedImage::decompress(compressed.first)
+              .saveToFile(jobs[k].output);
+      } catch (const std::exception &e) {
+        result.error = e.what();
+      }
+      budget.release(team);
+      report(result);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < std::min<size_t>(threads, jobs.size()); t++)
+    workers.emplace_back(work);
+  for (auto &worker : workers)
+    worker.join();
+  loader.join();
+}
+
+std::vector<std::string>
+listImages(const std::vector<std::string> &paths,
+           const std::vector<std::string> &extensions) {
+  std::vector<std::string> res;
+  for (const auto &path : paths) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+      res.push_back(path);
+      continue;
+    }
+    std::vector<std::string> files;
+    if (DIR *dir = opendir(path.c_str())) {
+      while (dirent *entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (std::any_of(std::begin(extensions), std::end(extensions),
+                        [&](const std::string &extension) {
+                          return hasExtension(name, extension);
+                        }))
+          files.push_back(path + "/" + name);
+      }
+      closedir(dir);
+    }
+    std::sort(std::begin(files), std::end(files));
+    res.insert(std::end(res), std::begin(files), std::end(files));
+  }
+  return res;
+}
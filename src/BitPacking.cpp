@@ -0,0 +1,84 @@
+#include "BitPacking.hpp"
+
+#include <cassert>
+#include <cstring>
+
+// Little endian word at `p`
+static uint64_t loadWord(const uint8_t *p) {
+  uint64_t res;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  std::memcpy(&res, p, sizeof(res));
+#else
+  res = 0;
+  for (size_t i = 0; i < sizeof(res); i++)
+    res |= (uint64_t)p[i] << (8 * i);
+#endif
+  return res;
+}
+
+static void storeWord(uint8_t *p, uint64_t x) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  std::memcpy(p, &x, sizeof(x));
+#else
+  for (size_t i = 0; i < sizeof(x); i++)
+    p[i] = (uint8_t)(x >> (8 * i));
+#endif
+}
+
+size_t packedSize(size_t count, unsigned bits) {
+  return (count * bits + 7) / 8;
+}
+
+std::vector<uint8_t> packBits(const std::vector<size_t> &values,
+                              unsigned bits) {
+  assert(bits <= 32);
+  // Whole words are stored, so output gets a word of slack
+  std::vector<uint8_t> res(packedSize(values.size(), bits) + sizeof(uint64_t));
+  uint64_t word = 0;
+  unsigned filled = 0;
+  size_t pos = 0;
+  for (size_t v : values) {
+    word |= (uint64_t)v << filled;
+    filled += bits;
+    if (filled >= 32) {
+      storeWord(&res[pos], word);
+      pos += 4;
+      word >>= 32;
+      filled -= 32;
+    }
+  }
+  storeWord(&res[pos], word);
+  res.resize(packedSize(values.size(), bits));
+  return res;
+}
+
+std::vector<size_t> unpackBits(const uint8_t *data, size_t count,
+                               unsigned bits) {
+  assert(bits <= 32);
+  std::vector<size_t> res(count);
+  if (bits == 0)
+    return res;
+
+  const size_t size = packedSize(count, bits);
+  const uint64_t mask = ((uint64_t)1 << bits) - 1;
+  // Values whose word can be loaded without reading past the end
+  const size_t fast =
+      size >= sizeof(uint64_t)
+          ? std::min(count, ((size - sizeof(uint64_t)) * 8) / bits + 1)
+          : 0;
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < fast; i++) {
+    size_t bit = i * bits;
+    res[i] = (loadWord(data + bit / 8) >> (bit % 8)) & mask;
+  }
+
+  uint8_t tail[2 * sizeof(uint64_t)] = {};
+  size_t tailStart = fast * bits / 8;
+  std::memcpy(tail, data + tailStart, size - tailStart);
+  for (size_t i = fast; i < count; i++) {
+    size_t bit = i * bits - tailStart * 8;
+    res[i] = (loadWord(tail + bit / 8) >> (bit % 8)) & mask;
+  }
+  return res;
+}
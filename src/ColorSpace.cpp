@@ -1,61 +1,239 @@
 #include "ColorSpace.hpp"
 #include "VectorOperations.hpp"
 
+#include <cmath>
+
+typedef std::array<VectorType, 9> Matrix3;
+
 RGBDouble ColorSpace::RGBtoColorSpace(const RGB &c) {
-  return {(VectorType)c.at(0), (VectorType)c.at(1), (VectorType)c.at(2)};
+  return {(VectorType)(uint8_t)c.at(0), (VectorType)(uint8_t)c.at(1),
+          (VectorType)(uint8_t)c.at(2)};
 }
 
 RGB ColorSpace::colorSpaceToRGB(const RGBDouble &c) {
-  return {(char)std::round(c.at(0)), (char)std::round(c.at(1)),
-          (char)std::round(c.at(2))};
+  return {(char)(int)std::round(c.at(0)), (char)(int)std::round(c.at(1)),
+          (char)(int)std::round(c.at(2))};
+}
+
+void ColorSpace::RGBSpanToColorSpace(const RGB *in, size_t count,
+                                     VectorType *out) {
+  for (size_t i = 0; i < count; i++) {
+    RGBDouble c = RGBtoColorSpace(in[i]);
+    std::copy(std::begin(c), std::end(c), out + i * 3);
+  }
+}
+
+void ColorSpace::colorSpaceSpanToRGB(const VectorType *in, size_t count,
+                                     RGB *out) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = colorSpaceToRGB({in[i * 3], in[i * 3 + 1], in[i * 3 + 2]});
+}
+
+static Matrix3 inverse(const Matrix3 &m) {
+  VectorType det = m[0] * (m[4] * m[8] - m[5] * m[7]) -
+                   m[1] * (m[3] * m[8] - m[5] * m[6]) +
+                   m[2] * (m[3] * m[7] - m[4] * m[6]);
+  return {(m[4] * m[8] - m[5] * m[7]) / det, (m[2] * m[7] - m[1] * m[8]) / det,
+          (m[1] * m[5] - m[2] * m[4]) / det, (m[5] * m[6] - m[3] * m[8]) / det,
+          (m[0] * m[8] - m[2] * m[6]) / det, (m[2] * m[3] - m[0] * m[5]) / det,
+          (m[3] * m[7] - m[4] * m[6]) / det, (m[1] * m[6] - m[0] * m[7]) / det,
+          (m[0] * m[4] - m[1] * m[3]) / det};
+}
+
+static char toChannel(VectorType x) {
+  return (char)(uint8_t)std::min(std::max(std::round(x), (VectorType)0),
+                                 (VectorType)(MAX_COL - 1));
+}
+
+typedef std::array<VectorType, MAX_COL> ChannelTable;
+
+static ChannelTable scaledChannel(VectorType scale) {
+  ChannelTable res;
+  for (int b = 0; b < MAX_COL; b++)
+    res[b] = scale * b;
+  return res;
 }
 
-class ScaledColor : public ColorSpace {
+// Color space which is matrix applied to RGB components passed through
+// `transfer` table. Every (output, input) channel pair has its own table
+// of 256 products, so forward conversion is nine lookups and six additions
+// per pixel. Inverse conversion assumes linear transfer with step `scale`.
+class TableColorSpace : public ColorSpace {
 public:
-  ScaledColor() = default;
+  TableColorSpace(VectorType scale, const Matrix3 &matrix)
+      : TableColorSpace(scaledChannel(scale), matrix) {
+    this->scale = scale;
+  }
+
+  TableColorSpace(const ChannelTable &transfer, const Matrix3 &matrix)
+      : inverseMatrix(inverse(matrix)) {
+    for (size_t k = 0; k < matrix.size(); k++)
+      for (int b = 0; b < MAX_COL; b++)
+        table[k][b] = matrix[k] * transfer[b];
+  }
+
   RGBDouble RGBtoColorSpace(const RGB &c) override {
     RGBDouble res;
-    for (size_t i = 0; i < c.size(); i++)
-      res[i] = ((VectorType)c[i] + 128.0) / 255;
+    RGBSpanToColorSpace(&c, 1, res.data());
     return res;
   }
 
   RGB colorSpaceToRGB(const RGBDouble &c) override {
     RGB res;
-    for (size_t i = 0; i < c.size(); i++)
-      res[i] = (char)std::round((c[i] - 128.0) * 255);
+    colorSpaceSpanToRGB(c.data(), 1, &res);
     return res;
   }
+
+  void RGBSpanToColorSpace(const RGB *in, size_t count,
+                           VectorType *out) override {
+    for (size_t i = 0; i < count; i++)
+      applyTables(in[i], out + i * 3);
+  }
+
+  void colorSpaceSpanToRGB(const VectorType *in, size_t count,
+                           RGB *out) override {
+    for (size_t i = 0; i < count; i++) {
+      VectorType linear[3];
+      applyInverseMatrix(in + i * 3, linear);
+      for (size_t k = 0; k < 3; k++)
+        out[i][k] = toChannel(linear[k] / scale);
+    }
+  }
+
+protected:
+  void applyTables(const RGB &c, VectorType *out) const {
+    uint8_t r = c[0], g = c[1], b = c[2];
+    for (size_t k = 0; k < 3; k++)
+      out[k] = table[k * 3][r] + table[k * 3 + 1][g] + table[k * 3 + 2][b];
+  }
+
+  void applyInverseMatrix(const VectorType *c, VectorType *out) const {
+    const Matrix3 &m = inverseMatrix;
+    for (size_t k = 0; k < 3; k++)
+      out[k] = m[k * 3] * c[0] + m[k * 3 + 1] * c[1] + m[k * 3 + 2] * c[2];
+  }
+
+private:
+  VectorType scale = 1;
+  Matrix3 inverseMatrix;
+  std::array<ChannelTable, 9> table;
 };
 
-class Cie1931 : public ColorSpace {
+// CIELAB with D65 white point. sRGB decoding and normalization by white
+// point are folded into the channel tables, the cube root is sampled on
+// [0, 1] and interpolated linearly.
+class LabColorSpace : public TableColorSpace {
 public:
-  Cie1931() = default;
-  RGBDouble RGBtoColorSpace(const RGB &c) override {
-    return {(c[0] * 0.490 + c[1] * 0.310 + c[2] * 0.200) / 0.17697,
-            (c[0] * 0.17697 + c[1] * 0.81240 + c[2] * 0.01063) / 0.17697,
-            (c[0] * 0 + c[1] * 0.01 + c[2] * 0.99) / 0.17697};
+  LabColorSpace() : TableColorSpace(sRGBToLinear(), normalizedXYZ()) {
+    for (size_t i = 0; i < cubeRoot.size(); i++)
+      cubeRoot[i] = labTransfer((VectorType)i / CUBE_ROOT_STEPS);
   }
 
-  RGB colorSpaceToRGB(const RGBDouble &c) override {
-    RGBDouble tmp = {(c[0] * 0.418 + c[1] * (-0.15866) + c[2] * (-0.082835)),
-                     (c[0] * (-0.091169) + c[1] * 0.25243 + c[2] * 0.015708),
-                     (c[0] * 0.0009209 + c[1] * (-0.0025498) + c[2] * 0.17860)};
-    return {(char)std::round(tmp[0]), (char)std::round(tmp[1]),
-            (char)std::round(tmp[2])};
+  void RGBSpanToColorSpace(const RGB *in, size_t count,
+                           VectorType *out) override {
+    for (size_t i = 0; i < count; i++) {
+      VectorType xyz[3];
+      applyTables(in[i], xyz);
+      VectorType fx = lookupTransfer(xyz[0]), fy = lookupTransfer(xyz[1]),
+                 fz = lookupTransfer(xyz[2]);
+      out[i * 3] = 116 * fy - 16;
+      out[i * 3 + 1] = 500 * (fx - fy);
+      out[i * 3 + 2] = 200 * (fy - fz);
+    }
+  }
+
+  void colorSpaceSpanToRGB(const VectorType *in, size_t count,
+                           RGB *out) override {
+    for (size_t i = 0; i < count; i++) {
+      const VectorType *c = in + i * 3;
+      VectorType fy = (c[0] + 16) / 116;
+      VectorType xyz[3] = {inverseLabTransfer(fy + c[1] / 500),
+                           inverseLabTransfer(fy),
+                           inverseLabTransfer(fy - c[2] / 200)};
+      VectorType linear[3];
+      applyInverseMatrix(xyz, linear);
+      for (size_t k = 0; k < 3; k++)
+        out[i][k] = toChannel(linearToSRGB(linear[k]) * (MAX_COL - 1));
+    }
+  }
+
+private:
+  static const size_t CUBE_ROOT_STEPS = 4096;
+  static constexpr VectorType DELTA = 6.0 / 29;
+
+  static ChannelTable sRGBToLinear() {
+    ChannelTable res;
+    for (int b = 0; b < MAX_COL; b++) {
+      VectorType c = (VectorType)b / (MAX_COL - 1);
+      res[b] = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+    }
+    return res;
+  }
+
+  static VectorType linearToSRGB(VectorType c) {
+    return c <= 0.0031308 ? c * 12.92 : 1.055 * std::pow(c, 1 / 2.4) - 0.055;
+  }
+
+  static Matrix3 normalizedXYZ() {
+    Matrix3 m = {0.4124564, 0.3575761, 0.1804375, 0.2126729, 0.7151522,
+                 0.0721750, 0.0193339, 0.1191920, 0.9503041};
+    const VectorType white[3] = {0.95047, 1.0, 1.08883};
+    for (size_t k = 0; k < 3; k++)
+      for (size_t j = 0; j < 3; j++)
+        m[k * 3 + j] /= white[k];
+    return m;
   }
+
+  static VectorType labTransfer(VectorType t) {
+    return t > DELTA * DELTA * DELTA ? std::cbrt(t)
+                                     : t / (3 * DELTA * DELTA) + 4.0 / 29;
+  }
+
+  static VectorType inverseLabTransfer(VectorType f) {
+    return f > DELTA ? f * f * f : 3 * DELTA * DELTA * (f - 4.0 / 29);
+  }
+
+  VectorType lookupTransfer(VectorType t) const {
+    VectorType x = t * CUBE_ROOT_STEPS;
+    if (x < 0 || x >= CUBE_ROOT_STEPS)
+      return labTransfer(t);
+    size_t i = (size_t)x;
+    VectorType frac = x - i;
+    return cubeRoot[i] + (cubeRoot[i + 1] - cubeRoot[i]) * frac;
+  }
+
+  std::array<VectorType, CUBE_ROOT_STEPS + 1> cubeRoot;
 };
 
+const Matrix3 IDENTITY = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+
+const Matrix3 CIE1931 = {0.490 / 0.17697,   0.310 / 0.17697,
+                         0.200 / 0.17697,   0.17697 / 0.17697,
+                         0.81240 / 0.17697, 0.01063 / 0.17697,
+                         0 / 0.17697,       0.01 / 0.17697,
+                         0.99 / 0.17697};
+
+// Full range JPEG YCbCr, chroma is centered at zero
+const Matrix3 YCBCR = {0.299,     0.587,     0.114,    -0.168736, -0.331264,
+                       0.5,       0.5,       -0.418688, -0.081312};
+
 ColorSpacePtr getColorSpace(ColorSpaces cs) {
   switch (cs) {
   case ColorSpaces::NORMAL:
-    return ColorSpacePtr(new ColorSpace());
+    return ColorSpacePtr(new TableColorSpace(1, IDENTITY));
     break;
   case ColorSpaces::CIE1931:
-    return ColorSpacePtr(new Cie1931());
+    return ColorSpacePtr(new TableColorSpace(1, CIE1931));
     break;
   case ColorSpaces::SCALED:
-    return ColorSpacePtr(new ScaledColor());
+    return ColorSpacePtr(new TableColorSpace(1.0 / (MAX_COL - 1), IDENTITY));
+    break;
+  case ColorSpaces::YCBCR:
+  case ColorSpaces::YCBCR420:
+    return ColorSpacePtr(new TableColorSpace(1.0 / (MAX_COL - 1), YCBCR));
+    break;
+  case ColorSpaces::LAB:
+    return ColorSpacePtr(new LabColorSpace());
     break;
   }
   return nullptr;
@@ -1,96 +1,424 @@
 #include "Compressor.hpp"
+#include "BitPacking.hpp"
 #include "Debug.hpp"
 #include "KDTree.hpp"
+#include "Metrics.hpp"
+#include "QuantFormat.hpp"
 #include "VectorOperations.hpp"
 
+#include <algorithm>
+#include <cassert>
 #include <chrono>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
 #include <iomanip>
+#include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 std::vector<CharVector>
 vectorsToCharVectorsColorSpaced(const std::vector<Vector> &vectors,
                                 const ColorSpacePtr &cs) {
   std::vector<CharVector> res;
-  std::transform(
-      begin(vectors), end(vectors), std::back_inserter(res),
-      [&](const Vector &a) {
-        CharVector res(a.size());
-        for (size_t i = 0; i < a.size(); i += 3) {
-          RGB unscaled = cs->colorSpaceToRGB({a[i], a[i + 1], a[i + 2]});
-          res[i] = unscaled.at(0);
-          res[i + 1] = unscaled.at(1);
-          res[i + 2] = unscaled.at(2);
-        }
-        return res;
-      });
+  for (const Vector &a : vectors) {
+    res.emplace_back(a.size());
+    cs->colorSpaceSpanToRGB(&a[0], a.size() / 3,
+                            reinterpret_cast<RGB *>(&res.back()[0]));
+  }
   return res;
 }
 
-std::vector<Vector> getBlocksAsVectorsFromImage(const RGBImage &image, int w,
+// Blocks are numbered row by row, components inside a block go pixel by
+// pixel in raster order. Image is padded to whole blocks by replicating
+// last column and last row.
+
+// Copies last pixel of a row into padding after it
+template <typename T>
+static void padRow(T *row, size_t xSize, size_t paddedSize,
+                   size_t channels = 3) {
+  for (size_t x = xSize; x < paddedSize; x++)
+    std::copy(&row[(xSize - 1) * channels], &row[xSize * channels],
+              &row[x * channels]);
+}
+
+std::vector<Vector> getBlocksAsVectorsFromImage(const RGBView &image, int w,
                                                 int h,
                                                 const ColorSpacePtr &cs) {
-  const std::vector<RGB> &img = image.img;
-
-  int xSize = image.xSize;
-  int ySize = image.ySize;
-
-  size_t wBlocks = (xSize + w - 1) / w;
-  size_t hBlocks = (ySize + h - 1) / h;
-
-  std::vector<Vector> res(wBlocks * hBlocks);
-
-  for (size_t i = 0; i < wBlocks; i++)
-    for (size_t j = 0; j < hBlocks; j++) {
-      Vector tmp(3 * w * h);
-      for (size_t x = i * w; x < i * w + w; x++)
-        for (size_t y = j * h; y < j * h + h; y++) {
-          size_t imgIndex = x * ySize + y;
-          size_t vecIndex = ((x - i * w) * h + (y - j * h)) * 3;
-
-          for (auto shift : RGBRange)
-            if (imgIndex < img.size()) {
-              RGBDouble scaled = cs->RGBtoColorSpace(img.at(imgIndex));
-              tmp.at(vecIndex + shift) = scaled.at(shift);
-            } else
-              tmp.at(vecIndex + shift) = 0;
-        }
-      res.at(i * hBlocks + j) = std::move(tmp);
-    }
+  const size_t xSize = image.xSize;
+  const size_t ySize = image.ySize;
+
+  const size_t wBlocks = (xSize + w - 1) / w;
+  const size_t hBlocks = (ySize + h - 1) / h;
+  const size_t blockRowSize = w * 3;
+
+  std::vector<Vector> res(wBlocks * hBlocks, Vector(3 * w * h));
+
+  #pragma omp parallel
+  {
+    std::vector<VectorType> row(wBlocks * blockRowSize);
+
+    #pragma omp for
+    for (size_t j = 0; j < hBlocks; j++)
+      for (size_t dy = 0; dy < (size_t)h; dy++) {
+        // Whole raster row is converted once, then split between blocks
+        size_t y = std::min(j * h + dy, ySize - 1);
+        cs->RGBSpanToColorSpace(image.row(y), xSize, row.data());
+        padRow(row.data(), xSize, wBlocks * w);
+
+        for (size_t i = 0; i < wBlocks; i++)
+          std::copy(&row[i * blockRowSize], &row[(i + 1) * blockRowSize],
+                    &res[j * wBlocks + i][dy * blockRowSize]);
+      }
+  }
   return res;
 }
 
-RGBImage getImageFromVectors(const std::vector<CharVector> &blocks, int xSize,
-                             int ySize, int w, int h) {
-  size_t wBlocks = (xSize + w - 1) / w;
-  size_t hBlocks = (ySize + h - 1) / h;
+ByteBlocks getBlocksAsBytesFromImage(const RGBView &image, int w, int h) {
+  return getBlocksAsBytesFromPlane(
+      reinterpret_cast<const uint8_t *>(image.pixels), image.xSize,
+      image.ySize, 3, w, h, image.stride);
+}
 
-  std::vector<RGB> imgData(xSize * ySize);
+// Plane is xSize * ySize pixels of `channels` interleaved bytes each, rows
+// are `stride` bytes apart (0 when packed)
+ByteBlocks getBlocksAsBytesFromPlane(const uint8_t *plane, size_t xSize,
+                                     size_t ySize, size_t channels, int w,
+                                     int h, size_t stride) {
+  if (!stride)
+    stride = xSize * channels;
+  const size_t wBlocks = (xSize + w - 1) / w;
+  const size_t hBlocks = (ySize + h - 1) / h;
+  const size_t blockRowSize = w * channels;
 
-  for (size_t i = 0; i < wBlocks; i++)
-    for (size_t j = 0; j < hBlocks; j++) {
-      const CharVector &tmp = blocks.at(i * hBlocks + j);
+  ByteBlocks res(wBlocks * hBlocks, channels * w * h);
 
-      for (size_t x = i * w; x < i * w + w; x++)
-        for (size_t y = j * h; y < j * h + h; y++) {
-          size_t imgIndex = x * ySize + y;
-          size_t vecIndex = ((x - i * w) * h + (y - j * h)) * 3;
+  #pragma omp parallel
+  {
+    std::vector<uint8_t> row(wBlocks * blockRowSize);
+
+    #pragma omp for
+    for (size_t j = 0; j < hBlocks; j++)
+      for (size_t dy = 0; dy < (size_t)h; dy++) {
+        size_t y = std::min(j * h + dy, ySize - 1);
+        const uint8_t *src = plane + y * stride;
+        std::copy(src, src + xSize * channels, std::begin(row));
+        padRow(row.data(), xSize, wBlocks * w, channels);
+
+        for (size_t i = 0; i < wBlocks; i++)
+          std::copy(&row[i * blockRowSize], &row[(i + 1) * blockRowSize],
+                    res[j * wBlocks + i] + dy * blockRowSize);
+      }
+  }
+  return res;
+}
 
-          if (imgIndex < imgData.size()) {
-            for (auto shift : RGBRange)
-              imgData.at(imgIndex).at(shift) = tmp.at(vecIndex + shift);
-          }
-        }
+// Inverse of block extraction, writes window [xBegin, xEnd) x [yBegin,
+// yEnd) of a plane to `dst`, `block(j, i)` points to components of block
+// in j-th block row and i-th block column. Blocks sticking out of the
+// window are clipped. Rows of `dst` are `dstStride` bytes apart, 0 means
+// packed. Row length is a template parameter for common block shapes so
+// copies get inlined, 0 means it is known only at runtime.
+template <size_t RowSize, typename Block>
+static void writeBlocksOfShape(const Block &block, char *dst, size_t xBegin,
+                               size_t yBegin, size_t xEnd, size_t yEnd,
+                               size_t channels, size_t w, size_t h,
+                               size_t dstStride) {
+  const size_t blockRowSize = RowSize ? RowSize : w * channels;
+  const size_t rowSize = dstStride ? dstStride : (xEnd - xBegin) * channels;
+
+  #pragma omp parallel for
+  for (size_t y = yBegin; y < yEnd; y++) {
+    char *row = dst + (y - yBegin) * rowSize;
+    const size_t j = y / h;
+    const size_t offset = (y % h) * blockRowSize;
+    size_t x = xBegin;
+    // Block cut by left edge of the window
+    if (x % w) {
+      const size_t n = std::min(w - x % w, xEnd - x);
+      std::memcpy(row, block(j, x / w) + offset + (x % w) * channels,
+                  n * channels);
+      row += n * channels;
+      x += n;
     }
+    for (; x + w <= xEnd; x += w, row += blockRowSize)
+      std::memcpy(row, block(j, x / w) + offset, blockRowSize);
+    if (x < xEnd)
+      std::memcpy(row, block(j, x / w) + offset, (xEnd - x) * channels);
+  }
+}
+
+template <typename Block>
+static void writeBlocks(const Block &block, char *dst, size_t xBegin,
+                        size_t yBegin, size_t xEnd, size_t yEnd,
+                        size_t channels, size_t w, size_t h,
+                        size_t dstStride = 0) {
+  switch (w * channels) {
+  case 2:
+    return writeBlocksOfShape<2>(block, dst, xBegin, yBegin, xEnd, yEnd,
+                                 channels, w, h, dstStride);
+  case 3:
+    return writeBlocksOfShape<3>(block, dst, xBegin, yBegin, xEnd, yEnd,
+                                 channels, w, h, dstStride);
+  case 4:
+    return writeBlocksOfShape<4>(block, dst, xBegin, yBegin, xEnd, yEnd,
+                                 channels, w, h, dstStride);
+  case 6:
+    return writeBlocksOfShape<6>(block, dst, xBegin, yBegin, xEnd, yEnd,
+                                 channels, w, h, dstStride);
+  case 8:
+    return writeBlocksOfShape<8>(block, dst, xBegin, yBegin, xEnd, yEnd,
+                                 channels, w, h, dstStride);
+  case 12:
+    return writeBlocksOfShape<12>(block, dst, xBegin, yBegin, xEnd, yEnd,
+                                  channels, w, h, dstStride);
+  default:
+    return writeBlocksOfShape<0>(block, dst, xBegin, yBegin, xEnd, yEnd,
+                                 channels, w, h, dstStride);
+  }
+}
+
+RGBImage getImageFromVectors(const std::vector<CharVector> &blocks, int xSize,
+                             int ySize, int w, int h) {
+  RGBImage img;
+  img.ySize = ySize;
+  img.xSize = xSize;
+  img.img.resize(xSize * ySize);
+  const size_t wBlocks = (xSize + w - 1) / w;
+  writeBlocks(
+      [&](size_t j, size_t i) { return blocks[j * wBlocks + i].data(); },
+      reinterpret_cast<char *>(img.img.data()), 0, 0, xSize, ySize, 3, w, h);
+  return img;
+}
+
+// Codebook laid out contiguously, codevector k starts at k * dimension
+static std::vector<char>
+flattenCodeVectors(const std::vector<CharVector> &codeVectors) {
+  std::vector<char> res;
+  for (const auto &c : codeVectors)
+    res.insert(std::end(res), std::begin(c), std::end(c));
+  return res;
+}
 
+RGBImage getImageFromCodeVectors(const std::vector<CharVector> &codeVectors,
+                                 const std::vector<size_t> &assignedCodeVector,
+                                 int xSize, int ySize, int w, int h) {
   RGBImage img;
   img.ySize = ySize;
   img.xSize = xSize;
-  img.img = std::move(imgData);
+  img.img.resize(xSize * ySize);
+  const std::vector<char> codebook = flattenCodeVectors(codeVectors);
+  CodebookSource source;
+  source.codeVectors = codebook.data();
+  source.indices = assignedCodeVector.data();
+  decodeRegion(ColorSpaces::NORMAL, xSize, w, h, source, {}, 0, 0, xSize,
+               ySize, img.img.data());
   return img;
 }
 
+// 4:2:0 planes are stored as bytes like in JPEG: luma is Y * 255, chroma
+// planes hold (Cb, Cr) pairs as C * 255 + 128, one pair per 2x2 pixels.
+
+static uint8_t toByte(VectorType x) {
+  return (uint8_t)std::min(std::max(std::round(x), (VectorType)0),
+                           (VectorType)(MAX_COL - 1));
+}
+
+static void toYCbCr420(const RGBView &image, const ColorSpacePtr &cs,
+                       std::vector<uint8_t> &luma,
+                       std::vector<uint8_t> &chroma) {
+  const size_t xSize = image.xSize;
+  const size_t ySize = image.ySize;
+  const size_t cxSize = (xSize + 1) / 2;
+  const size_t cySize = (ySize + 1) / 2;
+  luma.resize(xSize * ySize);
+  chroma.resize(cxSize * cySize * 2);
+
+  #pragma omp parallel
+  {
+    std::vector<VectorType> rows[2] = {std::vector<VectorType>(cxSize * 6),
+                                       std::vector<VectorType>(cxSize * 6)};
+
+    #pragma omp for
+    for (size_t cy = 0; cy < cySize; cy++) {
+      for (size_t dy = 0; dy < 2; dy++) {
+        size_t y = std::min(cy * 2 + dy, ySize - 1);
+        cs->RGBSpanToColorSpace(image.row(y), xSize, rows[dy].data());
+        padRow(rows[dy].data(), xSize, cxSize * 2);
+        for (size_t x = 0; x < xSize; x++)
+          luma[y * xSize + x] = toByte(rows[dy][x * 3] * (MAX_COL - 1));
+      }
+      for (size_t cx = 0; cx < cxSize; cx++)
+        for (size_t k = 1; k < 3; k++) {
+          VectorType sum = rows[0][cx * 6 + k] + rows[0][cx * 6 + 3 + k] +
+                           rows[1][cx * 6 + k] + rows[1][cx * 6 + 3 + k];
+          chroma[(cy * cxSize + cx) * 2 + k - 1] =
+              toByte(sum / 4 * (MAX_COL - 1) + MAX_COL / 2);
+        }
+    }
+  }
+}
+
+// Converts `width` pixels of a row of 4:2:0 planes starting at column
+// xBegin back to RGB. `chroma` starts at pair of column xBegin / 2, `row`
+// is scratch space of width * 3 components.
+static void fromYCbCr420Row(const uint8_t *luma, const uint8_t *chroma,
+                            size_t xBegin, size_t width,
+                            const ColorSpacePtr &cs,
+                            std::vector<VectorType> &row, RGB *out) {
+  for (size_t x = 0; x < width; x++) {
+    const size_t c = ((xBegin + x) / 2 - xBegin / 2) * 2;
+    row[x * 3] = (VectorType)luma[x] / (MAX_COL - 1);
+    row[x * 3 + 1] = ((VectorType)chroma[c] - MAX_COL / 2) / (MAX_COL - 1);
+    row[x * 3 + 2] =
+        ((VectorType)chroma[c + 1] - MAX_COL / 2) / (MAX_COL - 1);
+  }
+  cs->colorSpaceSpanToRGB(row.data(), width, out);
+}
+
+// Largest codebook ordered by greedy nearest neighbour path
+const size_t GREEDY_REORDER_LIMIT = 1 << 12;
+
+void reorderCodeVectors(std::vector<CharVector> &codeVectors,
+                        std::vector<size_t> &assignedCodeVector) {
+  const size_t n = codeVectors.size();
+  if (n < 2)
+    return;
+
+  auto distance = [&](size_t a, size_t b) {
+    uint32_t res = 0;
+    for (size_t j = 0; j < codeVectors[a].size(); j++) {
+      int32_t d = (int32_t)(uint8_t)codeVectors[a][j] -
+                  (int32_t)(uint8_t)codeVectors[b][j];
+      res += d * d;
+    }
+    return res;
+  };
+
+  // Sum of components orders codevectors from dark to bright in RGB and
+  // luma planes
+  std::vector<uint32_t> sums(n);
+  for (size_t k = 0; k < n; k++)
+    for (char c : codeVectors[k])
+      sums[k] += (uint8_t)c;
+  std::vector<size_t> order(n);
+  for (size_t k = 0; k < n; k++)
+    order[k] = k;
+
+  // Greedy path costs n^2 distances, big codebooks are just sorted by
+  // brightness
+  if (n > GREEDY_REORDER_LIMIT) {
+    std::stable_sort(std::begin(order), std::end(order),
+                     [&](size_t a, size_t b) { return sums[a] < sums[b]; });
+  } else {
+    // Start from the darkest codevector, always go to the nearest one not
+    // visited yet. Distance and index are packed so the smallest pair is
+    // the same whichever thread finds it.
+    std::vector<char> used(n);
+    size_t current = std::min_element(std::begin(sums), std::end(sums)) -
+                     std::begin(sums);
+    for (size_t step = 0; step < n; step++) {
+      order[step] = current;
+      used[current] = true;
+      uint64_t best = UINT64_MAX;
+      #pragma omp parallel for reduction(min : best)
+      for (size_t k = 0; k < n; k++)
+        if (!used[k])
+          best = std::min(best, (uint64_t)distance(current, k) << 32 | k);
+      current = (size_t)(best & UINT32_MAX);
+    }
+  }
+
+  std::vector<size_t> position(n);
+  std::vector<CharVector> reordered(n);
+  for (size_t k = 0; k < n; k++) {
+    position[order[k]] = k;
+    reordered[k] = std::move(codeVectors[order[k]]);
+  }
+  codeVectors = std::move(reordered);
+  for (auto &index : assignedCodeVector)
+    index = position[index];
+}
+
+// Places codevectors [begin, end) in a subtree holding up to `capacity`
+// leaves, first child takes half of it
+static void bisectCodeVectors(const std::vector<CharVector> &codeVectors,
+                              size_t *begin, size_t *end, size_t capacity) {
+  const size_t n = end - begin, half = capacity / 2;
+  if (n <= 1)
+    return;
+  if (n <= half)
+    return bisectCodeVectors(codeVectors, begin, end, half);
+
+  const size_t dim = codeVectors[*begin].size();
+  std::vector<double> mean(dim), axis(dim, 1.0);
+  for (size_t *c = begin; c != end; c++)
+    for (size_t j = 0; j < dim; j++)
+      mean[j] += (uint8_t)codeVectors[*c][j];
+  for (auto &m : mean)
+    m /= n;
+  auto projection = [&](size_t c, const std::vector<double> &v) {
+    double res = 0;
+    for (size_t j = 0; j < dim; j++)
+      res += ((uint8_t)codeVectors[c][j] - mean[j]) * v[j];
+    return res;
+  };
+  // Power iteration on scatter matrix, applied through the points
+  for (int iteration = 0; iteration < 8; iteration++) {
+    std::vector<double> next(dim);
+    for (size_t *c = begin; c != end; c++) {
+      const double p = projection(*c, axis);
+      for (size_t j = 0; j < dim; j++)
+        next[j] += ((uint8_t)codeVectors[*c][j] - mean[j]) * p;
+    }
+    double norm = 0;
+    for (double x : next)
+      norm += x * x;
+    if (norm == 0)
+      break;
+    for (size_t j = 0; j < dim; j++)
+      axis[j] = next[j] / std::sqrt(norm);
+  }
+
+  std::vector<std::pair<double, size_t>> order;
+  for (size_t *c = begin; c != end; c++)
+    order.emplace_back(projection(*c, axis), *c);
+  std::sort(std::begin(order), std::end(order));
+  for (size_t k = 0; k < n; k++)
+    begin[k] = order[k].second;
+  bisectCodeVectors(codeVectors, begin, begin + half, half);
+  bisectCodeVectors(codeVectors, begin + half, end, half);
+}
+
+void treeOrderCodeVectors(std::vector<CharVector> &codeVectors,
+                          std::vector<size_t> &assignedCodeVector) {
+  const size_t n = codeVectors.size();
+  std::vector<size_t> order(n);
+  for (size_t k = 0; k < n; k++)
+    order[k] = k;
+  bisectCodeVectors(codeVectors, order.data(), order.data() + n,
+                    (size_t)1 << bitsPerIndex(n));
+
+  std::vector<size_t> position(n);
+  std::vector<CharVector> reordered(n);
+  for (size_t k = 0; k < n; k++) {
+    position[order[k]] = k;
+    reordered[k] = std::move(codeVectors[order[k]]);
+  }
+  codeVectors = std::move(reordered);
+  for (auto &index : assignedCodeVector)
+    index = position[index];
+}
+
 std::chrono::duration<double>
 measureExecutionTime(const std::function<void()> &f) {
   std::chrono::time_point<std::chrono::system_clock> start, end;
@@ -104,166 +432,367 @@ measureExecutionTime(const std::function<void()> &f) {
   return executionTime;
 }
 
-std::pair<CompressedImage, CompressionRaport>
-CompressedImage::compress(const RGBImage &image, Quantizers quantizer,
-                          ColorSpaces colorSpace, int blockWidth,
-                          int blockHeight, VectorType eps, int N) {
-  std::vector<Vector> codeVectors;
-  std::vector<size_t> assignedCodeVector;
-  VectorType distortion;
+// Snapshot of a plane after a splitting phase: plane (1 is chroma of
+// YCBCR420), codebook in training set's domain and assignment. Returning
+// false stops splitting of that plane.
+typedef std::function<bool(size_t, const std::vector<Vector> &,
+                           const std::vector<size_t> &)>
+    SplitCallback;
+
+// Codebook trained on `colorSpace` blocks as bytes of image planes
+static std::vector<CharVector>
+toPlaneCodeVectors(ColorSpaces colorSpace, const ColorSpacePtr &cs,
+                   const std::vector<Vector> &vectors) {
+  if (colorSpace == ColorSpaces::NORMAL ||
+      colorSpace == ColorSpaces::YCBCR420)
+    return toCharVectors(vectors);
+  return vectorsToCharVectorsColorSpaced(vectors, cs);
+}
 
-  auto colorSpacePtr = getColorSpace(colorSpace);
-  auto quantizerPtr = getQuantizer(quantizer);
+// Trains codebooks of image, codebooks are not reordered yet
+static CompressedImage train(const RGBView &image, Quantizers quantizer,
+                             ColorSpaces colorSpace, int blockWidth,
+                             int blockHeight, VectorType eps, int N,
+                             const CompressionParameters &parameters,
+                             const SplitCallback &onSplit = nullptr) {
+  CompressedImage res;
+  res.xSize = image.xSize;
+  res.ySize = image.ySize;
+  res.blockWidth = blockWidth;
+  res.blockHeight = blockHeight;
+  res.colorSpace = colorSpace;
+  res.quantizer = quantizer;
+  res.progressive = parameters.progressive;
 
-  auto compressionTime = measureExecutionTime([&]() {
+  auto colorSpacePtr = getColorSpace(colorSpace);
+  auto planeParameters = [&](size_t plane) {
+    QuantizerParameters res = parameters;
+    if (onSplit)
+      res.onSplit = [&onSplit, plane](const std::vector<Vector> &codeVectors,
+                                      const std::vector<size_t> &assigned,
+                                      VectorType) {
+        return onSplit(plane, codeVectors, assigned);
+      };
+    return res;
+  };
+
+  if (colorSpace == ColorSpaces::YCBCR420) {
+    std::vector<uint8_t> luma, chroma;
+    toYCbCr420(image, colorSpacePtr, luma, chroma);
+    auto lumaSet = getBlocksAsBytesFromPlane(luma.data(), image.xSize,
+                                             image.ySize, 1, blockWidth,
+                                             blockHeight);
+    auto chromaSet = getBlocksAsBytesFromPlane(
+        chroma.data(), (image.xSize + 1) / 2, (image.ySize + 1) / 2, 2,
+        blockWidth, blockHeight);
+
+    // Codebooks are independent, so both are trained at once. Chroma has
+    // a quarter of vectors of twice the dimension, so it gets about a
+    // third of threads.
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    auto trainPlane = [&](const ByteBlocks &trainingSet, size_t plane,
+                          int teamSize) {
+#ifdef _OPENMP
+      omp_set_num_threads(std::max(teamSize, 1));
+#endif
+      return getQuantizer(quantizer, planeParameters(plane))
+          ->quantize(trainingSet, N, eps);
+    };
+    auto lumaResult =
+        std::async(std::launch::async, trainPlane, std::cref(lumaSet), 0,
+                   threads - threads / 3);
+    auto chromaResult = std::async(std::launch::async, trainPlane,
+                                   std::cref(chromaSet), 1, threads / 3);
+    std::tie(res.codeVectors, res.assignedCodeVector, std::ignore) =
+        lumaResult.get();
+    std::tie(res.chromaCodeVectors, res.chromaAssignedCodeVector,
+             std::ignore) = chromaResult.get();
+  } else if (colorSpace == ColorSpaces::NORMAL) {
+    // Components are exact bytes, train on them directly
     auto trainingSet =
-        getBlocksAsVectorsFromImage(image, blockWidth, blockHeight, colorSpacePtr);
-    std::tie(codeVectors, assignedCodeVector, distortion) =
-        quantizerPtr->quantize(trainingSet, N, eps);
+        getBlocksAsBytesFromImage(image, blockWidth, blockHeight);
+    std::tie(res.codeVectors, res.assignedCodeVector, std::ignore) =
+        getQuantizer(quantizer, planeParameters(0))
+            ->quantize(trainingSet, N, eps);
+  } else {
+    std::vector<Vector> scaledCodeVectors;
+    auto trainingSet = getBlocksAsVectorsFromImage(image, blockWidth,
+                                                   blockHeight, colorSpacePtr);
+    std::tie(scaledCodeVectors, res.assignedCodeVector, std::ignore) =
+        getQuantizer(quantizer, planeParameters(0))
+            ->quantize(trainingSet, N, eps);
+    res.codeVectors =
+        vectorsToCharVectorsColorSpaced(scaledCodeVectors, colorSpacePtr);
+  }
+  return res;
+}
+
+// Reorders codebooks for entropy coding, then measures size and quality
+static std::pair<CompressedImage, CompressionRaport>
+finishCompression(const RGBView &image, CompressedImage resImg,
+                  std::chrono::duration<double> compressionTime) {
+  compressionTime += measureExecutionTime([&]() {
+    // Split order says nothing about similarity, nearby indices should
+    // mean similar codevectors for entropy coding
+    auto reorder =
+        resImg.progressive ? treeOrderCodeVectors : reorderCodeVectors;
+    reorder(resImg.codeVectors, resImg.assignedCodeVector);
+    if (resImg.colorSpace == ColorSpaces::YCBCR420)
+      reorder(resImg.chromaCodeVectors, resImg.chromaAssignedCodeVector);
   });
 
-  CompressedImage resImg;
-  resImg.codeVectors = vectorsToCharVectorsColorSpaced(codeVectors, colorSpacePtr);
-  resImg.assignedCodeVector = std::move(assignedCodeVector);
-  resImg.xSize = image.xSize;
-  resImg.ySize = image.ySize;
-  resImg.blockWidth = blockWidth;
-  resImg.blockHeight = blockHeight;
+  size_t compressedBits = resImg.sizeInBits();
+  float bitsPerPixel = ((float)compressedBits) / (image.xSize * image.ySize);
 
-  float bitsPerPixel =
-      ((float)resImg.sizeInBits()) / (image.xSize * image.ySize);
-
-  // Decompress image temporarily to compute real distortion
-  {
-    RGBImage img = decompress(resImg);
-    distortion = 0;
-    for (size_t i = 0; i < image.img.size(); i++) {
-      for (auto j : RGBRange)
-        distortion += std::pow(
-            (VectorType)image.img[i][j] - (VectorType)img.img[i][j], 2);
-    }
-    distortion /= image.img.size() * 3;
-  }
+  QualityMetrics quality = measureQuality(image, resImg);
 
   size_t uncompressedSize = image.sizeInBytes();
-  size_t compressedSize = resImg.sizeInBits() / 8;
+  size_t compressedSize = compressedBits / 8;
 
-  CompressionRaport raport{distortion, bitsPerPixel, uncompressedSize,
+  CompressionRaport raport{quality.mse,    quality.psnr,     quality.ssim,
+                           quality.msSsim, bitsPerPixel,     uncompressedSize,
                            compressedSize, compressionTime};
-  return std::make_pair(resImg, raport);
+  return std::make_pair(std::move(resImg), raport);
 }
 
-RGBImage CompressedImage::decompress(const CompressedImage &cImg) {
-  std::vector<CharVector> quantizedTrainingSet(cImg.assignedCodeVector.size());
-  for (size_t i = 0; i < quantizedTrainingSet.size(); i++)
-    quantizedTrainingSet[i] = cImg.codeVectors[cImg.assignedCodeVector[i]];
-
-  RGBImage res =
-      getImageFromVectors(quantizedTrainingSet, cImg.xSize, cImg.ySize,
-                          cImg.blockWidth, cImg.blockHeight);
-  return res;
+std::pair<CompressedImage, CompressionRaport>
+CompressedImage::compress(const RGBView &image, Quantizers quantizer,
+                          ColorSpaces colorSpace, int blockWidth,
+                          int blockHeight, VectorType eps, int N,
+                          const CompressionParameters &parameters) {
+  CompressedImage resImg;
+  auto compressionTime = measureExecutionTime([&]() {
+    resImg = train(image, quantizer, colorSpace, blockWidth, blockHeight, eps,
+                   N, parameters);
+  });
+  return finishCompression(image, std::move(resImg), compressionTime);
 }
 
-size_t smallestPow2(size_t n) {
-  int p = 0;
-  while (n /= 2)
-    p++;
-  return p;
+// True when `point` meets target of parameters, for bit rate target it
+// means the point went over budget
+static bool reachesTarget(const CompressionRaport &point,
+                          const CompressionParameters &parameters) {
+  return (parameters.targetPsnr > 0 && point.psnr >= parameters.targetPsnr) ||
+         (parameters.targetBitsPerPixel > 0 &&
+          point.bitsPerPixel > parameters.targetBitsPerPixel);
 }
 
-size_t CompressedImage::sizeInBits() {
-  // At this moment approximate size
-  size_t codeVectorBits = smallestPow2(codeVectors.size());
-  size_t dimension = blockWidth * blockHeight;
-  size_t bits = codeVectorBits * assignedCodeVector.size() +
-                dimension * codeVectors.size() * 8 * 3; // Store codevectors
+std::vector<std::pair<CompressedImage, CompressionRaport>>
+CompressedImage::compressRatePoints(const RGBView &image,
+                                    Quantizers quantizer,
+                                    ColorSpaces colorSpace, int blockWidth,
+                                    int blockHeight, VectorType eps,
+                                    const std::vector<int> &levels,
+                                    const CompressionParameters &parameters) {
+  assert(!levels.empty());
+  const std::set<size_t> wanted(std::begin(levels), std::end(levels));
+  const bool targeted =
+      parameters.targetPsnr > 0 || parameters.targetBitsPerPixel > 0;
+  CompressionParameters runParameters = parameters;
+  runParameters.codeVectors = 0;
 
-  return ((bits + 7) / 8) * 8; // align
-}
+  auto colorSpacePtr = getColorSpace(colorSpace);
+  auto start = std::chrono::system_clock::now();
+  std::vector<std::pair<CompressedImage, CompressionRaport>> res;
+  CompressedImage snapshot;
+  snapshot.xSize = image.xSize;
+  snapshot.ySize = image.ySize;
+  snapshot.blockWidth = blockWidth;
+  snapshot.blockHeight = blockHeight;
+  snapshot.colorSpace = colorSpace;
+  snapshot.quantizer = quantizer;
+  snapshot.progressive = parameters.progressive;
+
+  // Codebooks of requested levels by plane, YCBCR420 planes are trained
+  // concurrently and paired once both are done
+  std::map<size_t, std::pair<std::vector<CharVector>, std::vector<size_t>>>
+      planeLevels[2];
+  std::mutex mutex;
+
+  train(image, quantizer, colorSpace, blockWidth, blockHeight, eps,
+        *wanted.rbegin(), runParameters,
+        [&](size_t plane, const std::vector<Vector> &codeVectors,
+            const std::vector<size_t> &assigned) {
+          const size_t level = bitsPerIndex(codeVectors.size());
+          if (((size_t)1 << level) != codeVectors.size() ||
+              !wanted.count(level))
+            return true;
+          auto charVectors =
+              toPlaneCodeVectors(colorSpace, colorSpacePtr, codeVectors);
+          if (colorSpace == ColorSpaces::YCBCR420) {
+            std::lock_guard<std::mutex> lock(mutex);
+            planeLevels[plane][level] = {std::move(charVectors), assigned};
+            return true;
+          }
 
-template<typename T, typename U>
-T align(T x, U a)
-{
-    return ((x+a-1)/a)*a;
+          snapshot.codeVectors = std::move(charVectors);
+          snapshot.assignedCodeVector = assigned;
+          res.push_back(finishCompression(image, snapshot,
+                                          std::chrono::system_clock::now() -
+                                              start));
+          return !targeted || !reachesTarget(res.back().second, parameters);
+        });
+
+  if (colorSpace == ColorSpaces::YCBCR420) {
+    const auto elapsed = std::chrono::system_clock::now() - start;
+    for (auto &level : planeLevels[0]) {
+      std::tie(snapshot.codeVectors, snapshot.assignedCodeVector) =
+          std::move(level.second);
+      std::tie(snapshot.chromaCodeVectors, snapshot.chromaAssignedCodeVector) =
+          std::move(planeLevels[1][level.first]);
+      res.push_back(finishCompression(image, snapshot, elapsed));
+      if (targeted && reachesTarget(res.back().second, parameters))
+        break;
+    }
+  }
+
+  if (targeted) {
+    // Point over bit rate budget is dropped unless nothing fits
+    if (res.size() > 1 && parameters.targetBitsPerPixel > 0 &&
+        res.back().second.bitsPerPixel > parameters.targetBitsPerPixel)
+      res.pop_back();
+    res.erase(std::begin(res), std::end(res) - 1);
+  }
+  return res;
 }
 
-void CompressedImage::saveToFile(const std::string &path) {
-  size_t bitsPerCodeVector = smallestPow2(codeVectors.size());
-  assert(bitsPerCodeVector <= 24);
-
-  std::ofstream file(path);
-  file 
-    << bitsPerCodeVector << ' ' 
-    << (int)colorSpace << ' '
-    << assignedCodeVector.size() << ' ' 
-    << xSize << ' ' 
-    << ySize << ' ' 
-    << blockWidth << ' ' 
-    << blockHeight;
-
-  file.write("\n", 1);
-
-  size_t codeVectorSize = blockWidth * blockHeight * 3;
-
-  // Write codeVectors first
-  assert((1 << bitsPerCodeVector) == codeVectors.size());
-  std::vector<char> tmp(codeVectorSize);
-  for (size_t i = 0; i < codeVectors.size(); i++)
-  {
-    std::copy(std::begin(codeVectors[i]), std::end(codeVectors[i]), std::begin(tmp));
-    file.write(tmp.data(), codeVectorSize);
+// Window [xBegin, xEnd) x [yBegin, yEnd) of plane coded with `source`
+static void writeSource(const CodebookSource &source, char *dst,
+                        size_t xBegin, size_t yBegin, size_t xEnd,
+                        size_t yEnd, size_t xSize, size_t channels, size_t w,
+                        size_t h, size_t dstStride = 0) {
+  const char *codeVectors = source.codeVectors;
+  const size_t dim = w * h * channels;
+  const size_t stride = source.stride ? source.stride : (xSize + w - 1) / w;
+  const size_t blockX = source.blockX, blockY = source.blockY;
+  if (source.indices) {
+    const size_t *indices = source.indices;
+    writeBlocks(
+        [=](size_t j, size_t i) {
+          return codeVectors +
+                 indices[(j - blockY) * stride + i - blockX] * dim;
+        },
+        dst, xBegin, yBegin, xEnd, yEnd, channels, w, h, dstStride);
+  } else {
+    const uint8_t *packed = source.packedIndices;
+    const unsigned bits = source.bitsPerIndex;
+    writeBlocks(
+        [=](size_t j, size_t i) {
+          return codeVectors +
+                 unpackOne(packed, (j - blockY) * stride + i - blockX, bits) *
+                     dim;
+        },
+        dst, xBegin, yBegin, xEnd, yEnd, channels, w, h, dstStride);
   }
+}
 
-  int bytesPerCodeVector = align(bitsPerCodeVector, 8) / 8;
+void decodeRegion(ColorSpaces colorSpace, size_t xSize, size_t blockWidth,
+                  size_t blockHeight, const CodebookSource &main,
+                  const CodebookSource &chroma, size_t xBegin, size_t yBegin,
+                  size_t xEnd, size_t yEnd, RGB *out, size_t outStride) {
+  if (colorSpace != ColorSpaces::YCBCR420) {
+    writeSource(main, reinterpret_cast<char *>(out), xBegin, yBegin, xEnd,
+                yEnd, xSize, 3, blockWidth, blockHeight, outStride);
+    return;
+  }
 
-  for (size_t i = 0; i < assignedCodeVector.size(); i++) 
+  const size_t width = xEnd - xBegin;
+  if (!outStride)
+    outStride = width * sizeof(RGB);
+  const size_t cxSize = (xSize + 1) / 2;
+  const size_t cxBegin = xBegin / 2, cxEnd = (xEnd + 1) / 2;
+  const size_t cyBegin = yBegin / 2, cyEnd = (yEnd + 1) / 2;
+  const size_t cWidth = cxEnd - cxBegin;
+  std::vector<uint8_t> luma((yEnd - yBegin) * width);
+  std::vector<uint8_t> chromaPlane((cyEnd - cyBegin) * cWidth * 2);
+  writeSource(main, reinterpret_cast<char *>(luma.data()), xBegin, yBegin,
+              xEnd, yEnd, xSize, 1, blockWidth, blockHeight);
+  writeSource(chroma, reinterpret_cast<char *>(chromaPlane.data()), cxBegin,
+              cyBegin, cxEnd, cyEnd, cxSize, 2, blockWidth, blockHeight);
+
+  auto cs = getColorSpace(colorSpace);
+  #pragma omp parallel
   {
-    char *cur = reinterpret_cast<char *>(&assignedCodeVector[i]);
-    file.write(cur, bytesPerCodeVector);
+    std::vector<VectorType> row(width * 3);
+
+    #pragma omp for
+    for (size_t y = yBegin; y < yEnd; y++)
+      fromYCbCr420Row(&luma[(y - yBegin) * width],
+                      &chromaPlane[(y / 2 - cyBegin) * cWidth * 2], xBegin,
+                      width, cs, row,
+                      reinterpret_cast<RGB *>(reinterpret_cast<char *>(out) +
+                                              (y - yBegin) * outStride));
   }
+}
 
-  file.flush();
-  file.close();
+RGBImage CompressedImage::decompress(const CompressedImage &cImg) {
+  RGBImage img;
+  img.xSize = cImg.xSize;
+  img.ySize = cImg.ySize;
+  img.img.resize(img.xSize * img.ySize);
+  cImg.decompressRows(0, img.ySize, img.img.data());
+  return img;
 }
 
-void CompressedImage::loadFromFile(const std::string &path) {
-  std::ifstream file(path);
+void CompressedImage::decompressRows(size_t yBegin, size_t yEnd,
+                                     RGB *out) const {
+  decompressRegion(0, yBegin, xSize, yEnd - yBegin, out);
+}
 
-  char skip;
-  size_t bitsPerCodeVector, assignedCodeVectorSize;
+void CompressedImage::decompressRegion(size_t x, size_t y, size_t w, size_t h,
+                                       RGB *out, size_t stride) const {
+  assert(x + w <= xSize && y + h <= ySize);
+  const std::vector<char> codebook = flattenCodeVectors(codeVectors);
+  const std::vector<char> chromaCodebook =
+      flattenCodeVectors(chromaCodeVectors);
+  CodebookSource main, chroma;
+  main.codeVectors = codebook.data();
+  main.indices = assignedCodeVector.data();
+  chroma.codeVectors = chromaCodebook.data();
+  chroma.indices = chromaAssignedCodeVector.data();
+  decodeRegion(colorSpace, xSize, blockWidth, blockHeight, main, chroma, x, y,
+               x + w, y + h, out, stride);
+}
 
-  int colorSpaceInt;
-  file 
-    >> bitsPerCodeVector
-    >> colorSpaceInt
-    >> assignedCodeVectorSize
-    >> xSize
-    >> ySize
-    >> blockWidth
-    >> blockHeight;
+// Bits needed to store index of one of n codevectors
+size_t bitsPerIndex(size_t n) {
+  size_t p = 0;
+  while (p < sizeof(size_t) * 8 && ((size_t)1 << p) < n)
+    p++;
+  return p;
+}
 
-  colorSpace = (ColorSpaces)colorSpaceInt;
-  file.read(&skip, 1);
+size_t CompressedImage::sizeInBits() {
+  std::ostringstream stream;
+  save(stream);
+  return stream.str().size() * 8;
+}
 
-  size_t codeVectorSize = blockWidth * blockHeight * 3;
+void CompressedImage::save(std::ostream &file) const {
+  writeQuantFile(*this, file);
+}
 
-  codeVectors.resize(1 << bitsPerCodeVector);
-  std::vector<char> tmp(codeVectorSize);
-  for (size_t i = 0; i < codeVectors.size(); i++)
-  {
-    codeVectors[i].resize(codeVectorSize);
-    file.read(tmp.data(), codeVectorSize);
-    std::copy(std::begin(tmp), std::end(tmp), std::begin(codeVectors[i]));
-  }
+void CompressedImage::load(std::istream &file) {
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  *this = QuantView(data.data(), data.size()).toCompressedImage();
+}
 
-  int bytesPerCodeVector = align(bitsPerCodeVector, 8) / 8;
-  assignedCodeVector.resize(assignedCodeVectorSize);
+void CompressedImage::saveToFile(const std::string &path) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file)
+    throw std::runtime_error("Cannot open " + path);
+  save(file);
+  file.flush();
+  if (!file)
+    throw std::runtime_error("Cannot write " + path);
+}
 
-  for (size_t i = 0; i < assignedCodeVector.size(); i++) {
-    char *cur = reinterpret_cast<char *>(&assignedCodeVector[i]);
-    file.read(cur, bytesPerCodeVector);
-  }
-  file.close();
+void CompressedImage::loadFromFile(const std::string &path) {
+  *this = MappedQuantFile(path).view().toCompressedImage();
 }
 
 std::string prettyPrintBytes(size_t bytes) {
@@ -291,6 +820,9 @@ std::ostream &operator<<(std::ostream &stream,
   stream << "Compression raport: " << std::endl;
   stream << "Distortion        = " << std::fixed << std::setprecision(10)
          << raport.distortion << std::endl;
+  stream << "PSNR              = " << raport.psnr << "dB" << std::endl;
+  stream << "SSIM              = " << raport.ssim << std::endl;
+  stream << "MS-SSIM           = " << raport.msSsim << std::endl;
   stream << "Bits per pixel    = " << raport.bitsPerPixel << std::endl;
   stream << "Uncompressed size = " << prettyPrintBytes(raport.uncompressedSize)
          << std::endl;
@@ -0,0 +1,305 @@
+#include "ContextCoding.hpp"
+#include "EntropyCoding.hpp"
+
+#include <cassert>
+#include <stdexcept>
+
+// Probabilities of zero bit are PROBABILITY_BITS fixed point numbers which
+// move 1/2^ADAPTATION_SHIFT of the way towards every coded bit
+const unsigned PROBABILITY_BITS = 11;
+const uint16_t PROBABILITY_HALF = 1 << (PROBABILITY_BITS - 1);
+const unsigned ADAPTATION_SHIFT = 5;
+const uint32_t RANGE_TOP = 1u << 24;
+// Explicit indices use a bit tree over at most this many leading bits,
+// remaining bits are coded with fixed probability
+const unsigned MAX_TREE_BITS = 16;
+
+// Carry-less range coder in the style of LZMA
+class RangeEncoder {
+public:
+  explicit RangeEncoder(std::vector<uint8_t> &out) : out(out) {}
+
+  void encode(uint16_t &probability, bool bit) {
+    uint32_t bound = (range >> PROBABILITY_BITS) * probability;
+    if (!bit) {
+      range = bound;
+      probability += ((1 << PROBABILITY_BITS) - probability) >> ADAPTATION_SHIFT;
+    } else {
+      low += bound;
+      range -= bound;
+      probability -= probability >> ADAPTATION_SHIFT;
+    }
+    normalize();
+  }
+
+  void encodeDirect(bool bit) {
+    range >>= 1;
+    if (bit)
+      low += range;
+    normalize();
+  }
+
+  void flush() {
+    for (int i = 0; i < 5; i++)
+      shiftLow();
+  }
+
+private:
+  void normalize() {
+    while (range < RANGE_TOP) {
+      range <<= 8;
+      shiftLow();
+    }
+  }
+
+  // Outputs top byte of `low`, bytes equal 0xff wait until carry is known
+  void shiftLow() {
+    if ((uint32_t)low < 0xff000000u || (low >> 32) != 0) {
+      uint8_t carry = (uint8_t)(low >> 32);
+      uint8_t byte = cache;
+      do {
+        out.push_back((uint8_t)(byte + carry));
+        byte = 0xff;
+      } while (--pending != 0);
+      cache = (uint8_t)(low >> 24);
+    }
+    pending++;
+    low = (low & 0x00ffffff) << 8;
+  }
+
+  std::vector<uint8_t> &out;
+  uint64_t low = 0;
+  uint32_t range = 0xffffffff;
+  uint8_t cache = 0;
+  uint64_t pending = 1;
+};
+
+class RangeDecoder {
+public:
+  RangeDecoder(const uint8_t *in, const uint8_t *end) : in(in), end(end) {
+    for (int i = 0; i < 5; i++)
+      code = (code << 8) | next();
+  }
+
+  bool decode(uint16_t &probability) {
+    uint32_t bound = (range >> PROBABILITY_BITS) * probability;
+    bool bit;
+    if (code < bound) {
+      range = bound;
+      probability += ((1 << PROBABILITY_BITS) - probability) >> ADAPTATION_SHIFT;
+      bit = false;
+    } else {
+      code -= bound;
+      range -= bound;
+      probability -= probability >> ADAPTATION_SHIFT;
+      bit = true;
+    }
+    normalize();
+    return bit;
+  }
+
+  bool decodeDirect() {
+    range >>= 1;
+    bool bit = code >= range;
+    if (bit)
+      code -= range;
+    normalize();
+    return bit;
+  }
+
+private:
+  uint8_t next() { return in < end ? *in++ : 0; }
+
+  void normalize() {
+    while (range < RANGE_TOP) {
+      range <<= 8;
+      code = (code << 8) | next();
+    }
+  }
+
+  const uint8_t *in;
+  const uint8_t *end;
+  uint32_t range = 0xffffffff;
+  uint32_t code = 0;
+};
+
+// How block's index was coded, part of context of blocks next to it
+enum Prediction { EXPLICIT, LEFT, TOP, PREDICTIONS };
+
+// Adaptive probabilities shared by encoder and decoder
+struct IndexModel {
+  explicit IndexModel(size_t alphabet) {
+    while (((size_t)1 << bits) < alphabet)
+      bits++;
+    treeBits = std::min(bits, MAX_TREE_BITS);
+    tree.assign((size_t)1 << treeBits, PROBABILITY_HALF);
+    for (auto &p : sameAsLeft)
+      p = PROBABILITY_HALF;
+    for (auto &p : sameAsTop)
+      p = PROBABILITY_HALF;
+  }
+
+  // Contexts are predictions of left and top blocks and whether their
+  // indices agree
+  static size_t context(Prediction left, Prediction top, bool agree) {
+    return (left * PREDICTIONS + top) * 2 + agree;
+  }
+
+  unsigned bits = 0;
+  unsigned treeBits;
+  uint16_t sameAsLeft[PREDICTIONS * PREDICTIONS * 2];
+  uint16_t sameAsTop[PREDICTIONS * PREDICTIONS * 2];
+  std::vector<uint16_t> tree;
+};
+
+void encodeIndexGrid(const std::vector<size_t> &indices, size_t width,
+                     size_t alphabet, std::vector<uint8_t> &out) {
+  std::vector<uint8_t> stream;
+  {
+    RangeEncoder encoder(stream);
+    IndexModel model(alphabet);
+    std::vector<Prediction> predictions(indices.size(), EXPLICIT);
+
+    for (size_t k = 0; k < indices.size(); k++) {
+      const bool hasLeft = k % width != 0, hasTop = k >= width;
+      const size_t index = indices[k];
+      const Prediction left = hasLeft ? predictions[k - 1] : EXPLICIT;
+      const Prediction top = hasTop ? predictions[k - width] : EXPLICIT;
+      const bool agree =
+          hasLeft && hasTop && indices[k - 1] == indices[k - width];
+      const size_t ctx = IndexModel::context(left, top, agree);
+
+      if (hasLeft) {
+        bool same = index == indices[k - 1];
+        encoder.encode(model.sameAsLeft[ctx], same);
+        if (same) {
+          predictions[k] = LEFT;
+          continue;
+        }
+      }
+      // Top is worth asking about only when it differs from left
+      if (hasTop && !agree) {
+        bool same = index == indices[k - width];
+        encoder.encode(model.sameAsTop[ctx], same);
+        if (same) {
+          predictions[k] = TOP;
+          continue;
+        }
+      }
+
+      size_t node = 1;
+      for (unsigned b = model.bits; b-- > model.bits - model.treeBits;) {
+        bool bit = (index >> b) & 1;
+        encoder.encode(model.tree[node], bit);
+        node = node * 2 + bit;
+      }
+      for (unsigned b = model.bits - model.treeBits; b-- > 0;)
+        encoder.encodeDirect((index >> b) & 1);
+    }
+    encoder.flush();
+  }
+  writeVarint(stream.size(), out);
+  out.insert(std::end(out), std::begin(stream), std::end(stream));
+}
+
+std::vector<size_t> decodeIndexGrid(const uint8_t *data, size_t size,
+                                    size_t &pos, size_t count, size_t width,
+                                    size_t alphabet) {
+  const uint64_t streamSize = readVarint(data, size, pos);
+  if (streamSize > size - pos)
+    throw std::runtime_error("Truncated index stream");
+  RangeDecoder decoder(data + pos, data + pos + streamSize);
+  pos += streamSize;
+
+  IndexModel model(alphabet);
+  std::vector<Prediction> predictions(count, EXPLICIT);
+  std::vector<size_t> indices(count);
+
+  for (size_t k = 0; k < count; k++) {
+    const bool hasLeft = k % width != 0, hasTop = k >= width;
+    const Prediction left = hasLeft ? predictions[k - 1] : EXPLICIT;
+    const Prediction top = hasTop ? predictions[k - width] : EXPLICIT;
+    const bool agree =
+        hasLeft && hasTop && indices[k - 1] == indices[k - width];
+    const size_t ctx = IndexModel::context(left, top, agree);
+
+    if (hasLeft && decoder.decode(model.sameAsLeft[ctx])) {
+      indices[k] = indices[k - 1];
+      predictions[k] = LEFT;
+      continue;
+    }
+    if (hasTop && !agree && decoder.decode(model.sameAsTop[ctx])) {
+      indices[k] = indices[k - width];
+      predictions[k] = TOP;
+      continue;
+    }
+
+    size_t node = 1;
+    for (unsigned b = 0; b < model.treeBits; b++)
+      node = node * 2 + decoder.decode(model.tree[node]);
+    size_t index = node - ((size_t)1 << model.treeBits);
+    for (unsigned b = model.bits - model.treeBits; b-- > 0;)
+      index = index * 2 + decoder.decodeDirect();
+    indices[k] = index;
+  }
+  return indices;
+}
+
+// Planes deeper than this share one context node each, bits there hardly
+// depend on the prefix
+const unsigned PLANE_NODE_BITS = 10;
+
+// Adaptive probabilities of one plane. Context is node of the block's
+// prefix in the codebook tree and state of left and top neighbours: no
+// neighbour or different prefix, same prefix with bit 0, or with bit 1.
+struct PlaneModel {
+  explicit PlaneModel(unsigned plane)
+      : plane(plane),
+        probabilities((plane < PLANE_NODE_BITS ? (size_t)1 << plane : 1) * 9,
+                      PROBABILITY_HALF) {}
+
+  uint16_t &probability(const std::vector<size_t> &prefixes,
+                        const std::vector<uint8_t> &planeBits, size_t k,
+                        size_t width) {
+    auto state = [&](bool has, size_t n) {
+      return has && prefixes[n] == prefixes[k] ? 1 + planeBits[n] : 0;
+    };
+    const size_t node = plane < PLANE_NODE_BITS ? prefixes[k] : 0;
+    return probabilities[node * 9 + state(k % width != 0, k - 1) * 3 +
+                         state(k >= width, k - width)];
+  }
+
+  unsigned plane;
+  std::vector<uint16_t> probabilities;
+};
+
+void encodeIndexPlane(const std::vector<size_t> &indices, size_t width,
+                      unsigned bits, unsigned plane,
+                      std::vector<uint8_t> &out) {
+  assert(plane < bits);
+  std::vector<size_t> prefixes(indices.size());
+  std::vector<uint8_t> planeBits(indices.size());
+  for (size_t k = 0; k < indices.size(); k++) {
+    prefixes[k] = indices[k] >> (bits - plane);
+    planeBits[k] = (indices[k] >> (bits - plane - 1)) & 1;
+  }
+
+  RangeEncoder encoder(out);
+  PlaneModel model(plane);
+  for (size_t k = 0; k < indices.size(); k++)
+    encoder.encode(model.probability(prefixes, planeBits, k, width),
+                   planeBits[k]);
+  encoder.flush();
+}
+
+void decodeIndexPlane(const uint8_t *data, size_t size, size_t width,
+                      unsigned plane, std::vector<size_t> &prefixes) {
+  RangeDecoder decoder(data, data + size);
+  PlaneModel model(plane);
+  std::vector<uint8_t> planeBits(prefixes.size());
+  for (size_t k = 0; k < prefixes.size(); k++)
+    planeBits[k] =
+        decoder.decode(model.probability(prefixes, planeBits, k, width));
+  for (size_t k = 0; k < prefixes.size(); k++)
+    prefixes[k] = prefixes[k] * 2 + planeBits[k];
+}
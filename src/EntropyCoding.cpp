@@ -0,0 +1,179 @@
+#include "EntropyCoding.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+#include <stdexcept>
+
+// Lower bound of normalized state, states are kept in [L, 256 L)
+const uint32_t RANS_L = 1u << 23;
+const size_t RANS_STATES = 4;
+
+void writeVarint(uint64_t x, std::vector<uint8_t> &out) {
+  while (x >= 0x80) {
+    out.push_back((uint8_t)(x | 0x80));
+    x >>= 7;
+  }
+  out.push_back((uint8_t)x);
+}
+
+uint64_t readVarint(const uint8_t *data, size_t size, size_t &pos) {
+  uint64_t res = 0;
+  for (unsigned shift = 0;; shift += 7) {
+    if (pos >= size || shift >= 64)
+      throw std::runtime_error("Truncated varint");
+    uint8_t b = data[pos++];
+    res |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return res;
+  }
+}
+
+// Probabilities are multiples of 2^-scaleBits, alphabet has to fit four
+// times so rare symbols are not distorted much
+static unsigned scaleBits(size_t alphabet) {
+  unsigned bits = 0;
+  while (((size_t)1 << bits) < alphabet)
+    bits++;
+  return std::min(std::max(bits + 2, 12u), 16u);
+}
+
+// Scales counts so they sum to 2^bits, every used symbol keeps at least 1
+static std::vector<uint32_t> normalize(const std::vector<uint64_t> &counts,
+                                       unsigned bits) {
+  const uint64_t total = (uint64_t)1 << bits;
+  const uint64_t n = std::accumulate(begin(counts), end(counts), (uint64_t)0);
+  std::vector<uint32_t> res(counts.size());
+  if (n == 0)
+    return res;
+
+  uint64_t sum = 0;
+  for (size_t s = 0; s < counts.size(); s++) {
+    if (counts[s])
+      res[s] = std::max<uint64_t>(1, counts[s] * total / n);
+    sum += res[s];
+  }
+
+  // Rounding error is taken from (or given to) the most frequent symbols
+  std::vector<size_t> order(counts.size());
+  std::iota(begin(order), end(order), 0);
+  std::sort(begin(order), end(order),
+            [&](size_t a, size_t b) { return res[a] > res[b]; });
+  if (sum < total)
+    res[order[0]] += total - sum;
+  for (size_t i = 0; sum > total; i++) {
+    uint32_t take = (uint32_t)std::min<uint64_t>(res[order[i]] - 1, sum - total);
+    res[order[i]] -= take;
+    sum -= take;
+  }
+  return res;
+}
+
+void ransEncode(const std::vector<uint32_t> &symbols, size_t alphabet,
+                std::vector<uint8_t> &out) {
+  assert(alphabet <= RANS_MAX_ALPHABET);
+  const unsigned bits = scaleBits(alphabet);
+
+  std::vector<uint64_t> counts(alphabet);
+  for (uint32_t s : symbols)
+    counts[s]++;
+  std::vector<uint32_t> freq = normalize(counts, bits);
+  std::vector<uint32_t> start(alphabet + 1);
+  std::partial_sum(begin(freq), end(freq), begin(start) + 1);
+
+  // Zero frequency is followed by number of further zeros
+  for (size_t s = 0; s < alphabet; s++) {
+    writeVarint(freq[s], out);
+    if (!freq[s]) {
+      size_t run = 0;
+      while (s + 1 < alphabet && !freq[s + 1])
+        run++, s++;
+      writeVarint(run, out);
+    }
+  }
+
+  // Symbols are encoded backwards into buffer filled from its end, so
+  // decoder reads it forwards
+  std::vector<uint8_t> stream(symbols.size() * 3 + RANS_STATES * 4 + 16);
+  size_t pos = stream.size();
+  uint32_t state[RANS_STATES];
+  std::fill(state, state + RANS_STATES, RANS_L);
+
+  for (size_t i = symbols.size(); i-- > 0;) {
+    uint32_t &x = state[i % RANS_STATES];
+    const uint32_t f = freq[symbols[i]];
+    const uint32_t xMax = ((RANS_L >> bits) << 8) * f;
+    while (x >= xMax) {
+      stream[--pos] = (uint8_t)x;
+      x >>= 8;
+    }
+    x = ((x / f) << bits) + (x % f) + start[symbols[i]];
+  }
+  // Final states go in front, least significant byte first
+  for (size_t k = RANS_STATES; k-- > 0;)
+    for (int b = 3; b >= 0; b--)
+      stream[--pos] = (uint8_t)(state[k] >> (8 * b));
+
+  writeVarint(stream.size() - pos, out);
+  out.insert(end(out), begin(stream) + pos, end(stream));
+}
+
+std::vector<uint32_t> ransDecode(const uint8_t *data, size_t size,
+                                 size_t &pos, size_t count, size_t alphabet) {
+  if (alphabet > RANS_MAX_ALPHABET)
+    throw std::runtime_error("rANS alphabet too big");
+  const unsigned bits = scaleBits(alphabet);
+  const uint32_t mask = (1u << bits) - 1;
+
+  // Slot of cumulative frequency to symbol, with its frequency and start
+  struct Slot {
+    uint32_t symbol;
+    uint16_t freq;
+    uint16_t offset;
+  };
+  std::vector<Slot> slots(1u << bits);
+  uint32_t start = 0;
+  for (size_t s = 0; s < alphabet; s++) {
+    uint32_t f = (uint32_t)readVarint(data, size, pos);
+    if (!f) {
+      const uint64_t run = readVarint(data, size, pos);
+      if (run >= alphabet - s)
+        throw std::runtime_error("rANS zero run past alphabet");
+      s += run;
+      continue;
+    }
+    if (f > slots.size() - start)
+      throw std::runtime_error("rANS frequencies exceed total");
+    for (uint32_t k = 0; k < f; k++)
+      slots[start + k] = {(uint32_t)s, (uint16_t)(f - 1), (uint16_t)k};
+    start += f;
+  }
+
+  // Table of used symbols has to cover all slots
+  if (count && start != slots.size())
+    throw std::runtime_error("rANS frequencies do not sum to total");
+
+  const uint64_t streamSize = readVarint(data, size, pos);
+  if (streamSize > size - pos || streamSize < RANS_STATES * 4)
+    throw std::runtime_error("Bad rANS stream size");
+  const uint8_t *in = data + pos;
+  const uint8_t *inEnd = in + streamSize;
+  pos += streamSize;
+
+  uint32_t state[RANS_STATES];
+  for (size_t k = 0; k < RANS_STATES; k++, in += 4)
+    state[k] = in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 |
+               (uint32_t)in[3] << 24;
+
+  std::vector<uint32_t> res(count);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t &x = state[i % RANS_STATES];
+    const Slot &slot = slots[x & mask];
+    res[i] = slot.symbol;
+    // Frequency is stored decremented so 2^16 fits in 16 bits
+    x = (slot.freq + 1) * (x >> bits) + slot.offset;
+    while (x < RANS_L && in < inEnd)
+      x = (x << 8) | *in++;
+  }
+  return res;
+}
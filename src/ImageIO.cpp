@@ -0,0 +1,87 @@
+#include "ImageIO.hpp"
+#include "Png.hpp"
+#include "Qoi.hpp"
+
+#include <fstream>
+#include <istream>
+#include <stdexcept>
+
+bool hasExtension(const std::string &path, const std::string &ext) {
+  return path.size() >= ext.size() &&
+         path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+ImageFormat imageFormat(const std::string &path) {
+  if (hasExtension(path, ".png"))
+    return ImageFormat::PNG;
+  if (hasExtension(path, ".qoi"))
+    return ImageFormat::QOI;
+  return ImageFormat::NETPBM;
+}
+
+std::vector<std::string> imageExtensions() {
+  return {".ppm", ".pgm", ".pbm", ".pnm", ".pam", ".png", ".qoi"};
+}
+
+ImageFile::ImageFile(const std::string &path)
+    : ImageFile(path, imageFormat(path)) {}
+
+ImageFile::ImageFile(const std::string &path, ImageFormat format)
+    : pixels(nullptr, 0, 0, 0) {
+  if (format == ImageFormat::NETPBM) {
+    netpbm.reset(new MappedNetpbmFile(path));
+    pixels = netpbm->view();
+    return;
+  }
+  MappedFile file(path);
+  decoded = format == ImageFormat::PNG ? readPng(file.data(), file.size())
+                                       : readQoi(file.data(), file.size());
+  pixels = decoded;
+}
+
+std::vector<uint8_t> readStream(std::istream &in) {
+  std::vector<uint8_t> res;
+  const size_t chunk = 1 << 20;
+  do {
+    res.resize(res.size() + chunk);
+    in.read(reinterpret_cast<char *>(&res[res.size() - chunk]), chunk);
+    res.resize(res.size() - chunk + in.gcount());
+  } while (in);
+  return res;
+}
+
+RGBImage readImage(std::istream &in, const std::string &path) {
+  const ImageFormat format = imageFormat(path);
+  if (format == ImageFormat::NETPBM)
+    return readNetpbm(in);
+  const std::vector<uint8_t> data = readStream(in);
+  return format == ImageFormat::PNG ? readPng(data.data(), data.size())
+                                    : readQoi(data.data(), data.size());
+}
+
+void writeImage(const RGBView &image, std::ostream &out,
+                const std::string &path) {
+  switch (imageFormat(path)) {
+  case ImageFormat::PNG:
+    return writePng(image, out);
+  case ImageFormat::QOI:
+    return writeQoi(image, out);
+  case ImageFormat::NETPBM:
+    NetpbmFormat netpbm = NetpbmFormat::PPM;
+    if (hasExtension(path, ".pgm"))
+      netpbm = NetpbmFormat::PGM;
+    else if (hasExtension(path, ".pam"))
+      netpbm = NetpbmFormat::PAM;
+    return writeNetpbm(image, out, netpbm);
+  }
+}
+
+void saveImage(const RGBView &image, const std::string &path) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file)
+    throw std::runtime_error("Cannot open " + path);
+  writeImage(image, file, path);
+  file.flush();
+  if (!file)
+    throw std::runtime_error("Cannot write " + path);
+}
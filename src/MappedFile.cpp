@@ -0,0 +1,31 @@
+#include "MappedFile.hpp"
+
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Cannot open " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("Cannot stat " + path);
+  }
+  length = st.st_size;
+  if (length)
+    mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    mapping = nullptr;
+    throw std::runtime_error("Cannot map " + path);
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (mapping)
+    munmap(mapping, length);
+}
@@ -0,0 +1,188 @@
+#include "Metrics.hpp"
+
+#include <cmath>
+#include <limits>
+
+// Rows decoded at once by one thread, must be even and multiple of
+// WINDOW_STEP
+const size_t BAND_ROWS = 32;
+const size_t WINDOW = 8;
+const size_t WINDOW_STEP = 4;
+const size_t MS_SSIM_SCALES = 5;
+const VectorType MS_SSIM_WEIGHTS[MS_SSIM_SCALES] = {0.0448, 0.2856, 0.3001,
+                                                    0.2363, 0.1333};
+const VectorType C1 = (0.01 * (MAX_COL - 1)) * (0.01 * (MAX_COL - 1));
+const VectorType C2 = (0.03 * (MAX_COL - 1)) * (0.03 * (MAX_COL - 1));
+
+static float luma(const RGB &c) {
+  return 0.299f * (uint8_t)c[0] + 0.587f * (uint8_t)c[1] +
+         0.114f * (uint8_t)c[2];
+}
+
+struct SSIMSums {
+  VectorType ssim = 0;
+  // Contrast and structure term, used by MS-SSIM on all but last scale
+  VectorType cs = 0;
+  size_t windows = 0;
+
+  void add(const SSIMSums &other) {
+    ssim += other.ssim;
+    cs += other.cs;
+    windows += other.windows;
+  }
+};
+
+// Adds windows with top row in [yBegin, yEnd) of plane ySize rows high,
+// yBegin has to be multiple of WINDOW_STEP. `a` and `b` hold rows from
+// yBegin on, xSize values each.
+static void accumulateWindows(const float *a, const float *b, size_t xSize,
+                              size_t ySize, size_t yBegin, size_t yEnd,
+                              SSIMSums &sums) {
+  const size_t wx = std::min(WINDOW, xSize), wy = std::min(WINDOW, ySize);
+  const VectorType n = wx * wy;
+  for (size_t y = yBegin; y < yEnd && y + wy <= ySize; y += WINDOW_STEP)
+    for (size_t x = 0; x + wx <= xSize; x += WINDOW_STEP) {
+      VectorType sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+      for (size_t dy = 0; dy < wy; dy++) {
+        const float *ra = a + (y - yBegin + dy) * xSize + x;
+        const float *rb = b + (y - yBegin + dy) * xSize + x;
+        for (size_t dx = 0; dx < wx; dx++) {
+          sa += ra[dx];
+          sb += rb[dx];
+          saa += ra[dx] * ra[dx];
+          sbb += rb[dx] * rb[dx];
+          sab += ra[dx] * rb[dx];
+        }
+      }
+      VectorType ma = sa / n, mb = sb / n;
+      VectorType va = saa / n - ma * ma, vb = sbb / n - mb * mb;
+      VectorType cov = sab / n - ma * mb;
+      VectorType cs = (2 * cov + C2) / (va + vb + C2);
+      sums.cs += cs;
+      sums.ssim += (2 * ma * mb + C1) / (ma * ma + mb * mb + C1) * cs;
+      sums.windows++;
+    }
+}
+
+// Averages 2x2 squares of `rows` rows, last row and column are replicated
+// when size is odd
+static void downsample(const float *src, size_t xSize, size_t rows,
+                       float *dst) {
+  const size_t halfX = (xSize + 1) / 2;
+  for (size_t y = 0; y < (rows + 1) / 2; y++) {
+    const float *r0 = src + 2 * y * xSize;
+    const float *r1 = src + std::min(2 * y + 1, rows - 1) * xSize;
+    for (size_t x = 0; x < halfX; x++) {
+      size_t x1 = std::min(2 * x + 1, xSize - 1);
+      dst[y * halfX + x] = (r0[2 * x] + r0[x1] + r1[2 * x] + r1[x1]) / 4;
+    }
+  }
+}
+
+static SSIMSums planeSSIM(const std::vector<float> &a,
+                          const std::vector<float> &b, size_t xSize,
+                          size_t ySize) {
+  const size_t bands = (ySize + BAND_ROWS - 1) / BAND_ROWS;
+  std::vector<SSIMSums> bandSums(bands);
+
+  #pragma omp parallel for
+  for (size_t band = 0; band < bands; band++) {
+    size_t yBegin = band * BAND_ROWS;
+    accumulateWindows(&a[yBegin * xSize], &b[yBegin * xSize], xSize, ySize,
+                      yBegin, std::min(yBegin + BAND_ROWS, ySize),
+                      bandSums[band]);
+  }
+
+  SSIMSums res;
+  for (const auto &s : bandSums)
+    res.add(s);
+  return res;
+}
+
+QualityMetrics measureQuality(const RGBView &original,
+                              const CompressedImage &compressed) {
+  const size_t xSize = original.xSize;
+  const size_t ySize = original.ySize;
+  const size_t bands = (ySize + BAND_ROWS - 1) / BAND_ROWS;
+  size_t halfX = (xSize + 1) / 2, halfY = (ySize + 1) / 2;
+
+  std::vector<float> halfA(halfX * halfY), halfB(halfX * halfY);
+  std::vector<VectorType> squaredError(bands);
+  std::vector<SSIMSums> bandSums(bands);
+
+  #pragma omp parallel
+  {
+    std::vector<RGB> decoded;
+    std::vector<float> a, b;
+
+    #pragma omp for schedule(dynamic)
+    for (size_t band = 0; band < bands; band++) {
+      size_t yBegin = band * BAND_ROWS;
+      size_t yEnd = std::min(yBegin + BAND_ROWS, ySize);
+      // Windows starting in this band reach into the next one
+      size_t yDecoded = std::min(yEnd + WINDOW - WINDOW_STEP, ySize);
+      size_t bandPixels = (yEnd - yBegin) * xSize;
+
+      decoded.resize((yDecoded - yBegin) * xSize);
+      a.resize(decoded.size());
+      b.resize(decoded.size());
+      compressed.decompressRows(yBegin, yDecoded, decoded.data());
+
+      VectorType error = 0;
+      for (size_t i = 0; i < decoded.size(); i++) {
+        const RGB &src = original.row(yBegin + i / xSize)[i % xSize];
+        if (i < bandPixels)
+          for (auto k : RGBRange) {
+            VectorType d = (VectorType)(uint8_t)src[k] -
+                           (VectorType)(uint8_t)decoded[i][k];
+            error += d * d;
+          }
+        a[i] = luma(src);
+        b[i] = luma(decoded[i]);
+      }
+      squaredError[band] = error;
+
+      accumulateWindows(a.data(), b.data(), xSize, ySize, yBegin, yEnd,
+                        bandSums[band]);
+      downsample(a.data(), xSize, yEnd - yBegin, &halfA[yBegin / 2 * halfX]);
+      downsample(b.data(), xSize, yEnd - yBegin, &halfB[yBegin / 2 * halfX]);
+    }
+  }
+
+  QualityMetrics res;
+  SSIMSums full;
+  for (size_t band = 0; band < bands; band++) {
+    res.mse += squaredError[band];
+    full.add(bandSums[band]);
+  }
+  res.mse /= xSize * ySize * 3;
+  res.psnr = res.mse > 0 ? 10 * std::log10((MAX_COL - 1) * (MAX_COL - 1) /
+                                           res.mse)
+                         : std::numeric_limits<VectorType>::infinity();
+  res.ssim = full.ssim / full.windows;
+
+  // Further scales are used while they still fit a whole window
+  std::vector<SSIMSums> scales = {full};
+  while (scales.size() < MS_SSIM_SCALES && std::min(halfX, halfY) >= WINDOW) {
+    scales.push_back(planeSSIM(halfA, halfB, halfX, halfY));
+    std::vector<float> nextA(((halfX + 1) / 2) * ((halfY + 1) / 2));
+    std::vector<float> nextB(nextA.size());
+    downsample(halfA.data(), halfX, halfY, nextA.data());
+    downsample(halfB.data(), halfX, halfY, nextB.data());
+    halfA = std::move(nextA);
+    halfB = std::move(nextB);
+    halfX = (halfX + 1) / 2;
+    halfY = (halfY + 1) / 2;
+  }
+
+  VectorType weights = 0;
+  for (size_t j = 0; j < scales.size(); j++)
+    weights += MS_SSIM_WEIGHTS[j];
+  res.msSsim = 1;
+  for (size_t j = 0; j < scales.size(); j++) {
+    VectorType value = j + 1 == scales.size() ? scales[j].ssim : scales[j].cs;
+    value = std::max(value / scales[j].windows, (VectorType)0);
+    res.msSsim *= std::pow(value, MS_SSIM_WEIGHTS[j] / weights);
+  }
+  return res;
+}
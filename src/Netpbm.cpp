@@ -0,0 +1,349 @@
+#include "Netpbm.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+// Bytes read from stream at once while parsing header
+const static size_t NETPBM_CHUNK = 1 << 16;
+
+static bool isSpace(uint8_t c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+static bool isDigit(uint8_t c) { return c >= '0' && c <= '9'; }
+
+[[noreturn]] static void fail(const std::string &what) {
+  throw std::runtime_error("Invalid Netpbm file: " + what);
+}
+
+// Cursor over header and plain rasters, comments run from '#' to the end
+// of line. Without stream it walks over [p, end), with one it refills
+// buffer from the stream whenever it runs out.
+struct NetpbmReader {
+  const uint8_t *p, *end;
+  std::istream *in = nullptr;
+  std::vector<uint8_t> buffer;
+
+  // True when there is a byte at p
+  bool more() {
+    if (p < end)
+      return true;
+    if (!in)
+      return false;
+    buffer.resize(NETPBM_CHUNK);
+    in->read(reinterpret_cast<char *>(buffer.data()), buffer.size());
+    p = buffer.data();
+    end = p + in->gcount();
+    return p < end;
+  }
+
+  void skipSpace() {
+    while (more()) {
+      if (*p == '#')
+        while (more() && *p != '\n')
+          p++;
+      else if (isSpace(*p))
+        p++;
+      else
+        break;
+    }
+  }
+
+  uint32_t number(const char *what) {
+    skipSpace();
+    if (!more() || !isDigit(*p))
+      fail(std::string("expected ") + what);
+    uint64_t res = 0;
+    while (more() && isDigit(*p)) {
+      res = res * 10 + (*p++ - '0');
+      if (res > UINT32_MAX)
+        fail(std::string(what) + " too big");
+    }
+    return (uint32_t)res;
+  }
+
+  std::string word() {
+    skipSpace();
+    std::string res;
+    while (more() && !isSpace(*p))
+      res += (char)*p++;
+    return res;
+  }
+
+  // Raw raster follows a single whitespace character
+  void rasterStart() {
+    if (!more() || !isSpace(*p))
+      fail("no whitespace before raster");
+    p++;
+  }
+
+  // Copies next n raw bytes to dst, the ones already buffered first
+  void read(uint8_t *dst, size_t n) {
+    const size_t buffered = std::min<size_t>(n, end - p);
+    std::memcpy(dst, p, buffered);
+    p += buffered;
+    if (buffered < n && !(in && in->read(reinterpret_cast<char *>(dst) +
+                                             buffered,
+                                         n - buffered)))
+      fail("truncated raster");
+  }
+};
+
+// Raster as described by header, samples of a pixel are interleaved
+struct Raster {
+  size_t width = 0, height = 0, depth = 0;
+  uint32_t maxval = 0;
+  bool plain = false;
+  // PBM packs 8 pixels per byte (raw) and has 1 for black
+  bool bitmap = false;
+};
+
+static void readPam(NetpbmReader &reader, Raster &raster) {
+  std::string tupleType;
+  for (;;) {
+    const std::string key = reader.word();
+    if (key == "ENDHDR")
+      break;
+    if (key == "WIDTH")
+      raster.width = reader.number("width");
+    else if (key == "HEIGHT")
+      raster.height = reader.number("height");
+    else if (key == "DEPTH")
+      raster.depth = reader.number("depth");
+    else if (key == "MAXVAL")
+      raster.maxval = reader.number("maxval");
+    else if (key == "TUPLTYPE")
+      tupleType = reader.word();
+    else
+      fail(key.empty() ? "PAM header without ENDHDR" : "PAM header " + key);
+  }
+  while (reader.more() && *reader.p != '\n')
+    reader.p++;
+  if (!reader.more())
+    fail("no raster");
+  reader.p++;
+
+  static const std::pair<const char *, size_t> depths[] = {
+      {"BLACKANDWHITE", 1}, {"GRAYSCALE", 1},   {"RGB", 3},
+      {"BLACKANDWHITE_ALPHA", 2}, {"GRAYSCALE_ALPHA", 2}, {"RGB_ALPHA", 4}};
+  if (raster.depth < 1 || raster.depth > 4)
+    fail("PAM depth has to be between 1 and 4");
+  if (!tupleType.empty()) {
+    auto known = std::find_if(
+        std::begin(depths), std::end(depths),
+        [&](const std::pair<const char *, size_t> &d) {
+          return tupleType == d.first;
+        });
+    if (known == std::end(depths))
+      throw std::runtime_error("Unsupported PAM tuple type " + tupleType);
+    if (known->second != raster.depth)
+      fail("PAM depth does not match tuple type");
+  }
+}
+
+static Raster readHeader(NetpbmReader &reader) {
+  uint8_t magic[2];
+  for (uint8_t &c : magic) {
+    if (!reader.more())
+      throw std::runtime_error("Not a Netpbm file");
+    c = *reader.p++;
+  }
+  if (magic[0] != 'P' || magic[1] < '1' || magic[1] > '7')
+    throw std::runtime_error("Not a Netpbm file");
+  const char kind = magic[1];
+
+  Raster res;
+  if (kind == '7') {
+    readPam(reader, res);
+  } else {
+    res.plain = kind <= '3';
+    res.bitmap = kind == '1' || kind == '4';
+    res.depth = kind == '3' || kind == '6' ? 3 : 1;
+    res.width = reader.number("width");
+    res.height = reader.number("height");
+    res.maxval = res.bitmap ? 1 : reader.number("maxval");
+    if (!res.plain)
+      reader.rasterStart();
+  }
+  if (res.width == 0 || res.height == 0)
+    fail("empty image");
+  if (res.maxval == 0 || res.maxval > 65535)
+    fail("maxval has to be between 1 and 65535");
+  if (res.width > SIZE_MAX / sizeof(RGB) / 2 / res.depth / res.height)
+    fail("image too big");
+  return res;
+}
+
+static size_t rawRowBytes(const Raster &raster) {
+  return raster.bitmap
+             ? (raster.width + 7) / 8
+             : raster.width * raster.depth * (raster.maxval > 255 ? 2 : 1);
+}
+
+// Raster of 8 bit RGB is stored just like RGB pixels
+static bool isRawRGB(const Raster &raster) {
+  return !raster.plain && raster.depth == 3 && raster.maxval == MAX_COL - 1;
+}
+
+// Every sample value mapped to 8 bits, rounded
+static std::vector<uint8_t> scaleTable(const Raster &raster) {
+  std::vector<uint8_t> res(raster.maxval + 1);
+  for (uint32_t v = 0; v <= raster.maxval; v++)
+    res[v] = (uint8_t)(((uint64_t)v * (MAX_COL - 1) + raster.maxval / 2) /
+                       raster.maxval);
+  if (raster.bitmap)
+    std::swap(res[0], res[1]);
+  return res;
+}
+
+static void toRGB(const uint32_t *samples, size_t depth,
+                  const std::vector<uint8_t> &scale, RGB &out) {
+  const bool gray = depth < 3;
+  for (size_t k = 0; k < 3; k++)
+    out[k] = (char)scale[samples[gray ? 0 : k]];
+}
+
+static void readPlain(NetpbmReader &reader, const Raster &raster,
+                      RGB *out) {
+  const std::vector<uint8_t> scale = scaleTable(raster);
+  const size_t pixels = raster.width * raster.height;
+  uint32_t samples[4];
+  for (size_t i = 0; i < pixels; i++) {
+    for (size_t k = 0; k < raster.depth; k++) {
+      if (raster.bitmap) {
+        // Plain PBM digits do not need separators
+        reader.skipSpace();
+        if (!reader.more() || (*reader.p != '0' && *reader.p != '1'))
+          fail("expected bit");
+        samples[k] = *reader.p++ - '0';
+      } else {
+        samples[k] = reader.number("sample");
+        if (samples[k] > raster.maxval)
+          fail("sample above maxval");
+      }
+    }
+    toRGB(samples, raster.depth, scale, out[i]);
+  }
+}
+
+static void readRaw(const uint8_t *data, const Raster &raster,
+                    size_t rowBytes, RGB *out) {
+  const std::vector<uint8_t> scale = scaleTable(raster);
+  const size_t width = raster.width, depth = raster.depth;
+  const bool wide = raster.maxval > 255;
+  const uint32_t maxval = raster.maxval;
+
+  #pragma omp parallel for
+  for (size_t y = 0; y < raster.height; y++) {
+    const uint8_t *src = data + y * rowBytes;
+    RGB *dst = out + y * width;
+    uint32_t samples[4];
+    for (size_t x = 0; x < width; x++) {
+      if (raster.bitmap) {
+        samples[0] = (src[x / 8] >> (7 - x % 8)) & 1;
+      } else {
+        for (size_t k = 0; k < depth; k++) {
+          const size_t s = x * depth + k;
+          uint32_t v = wide ? (uint32_t)src[2 * s] << 8 | src[2 * s + 1]
+                            : src[s];
+          samples[k] = std::min(v, maxval);
+        }
+      }
+      toRGB(samples, depth, scale, dst[x]);
+    }
+  }
+}
+
+NetpbmImage::NetpbmImage(const uint8_t *data, size_t size)
+    : pixels(nullptr, 0, 0, 0) {
+  NetpbmReader reader{data, data + size};
+  const Raster raster = readHeader(reader);
+  const size_t remaining = reader.end - reader.p;
+  const size_t width = raster.width, height = raster.height;
+
+  if (raster.plain) {
+    // Every sample takes at least one character
+    if (width > remaining / raster.depth / height)
+      fail("truncated raster");
+    converted.resize(width * height);
+    readPlain(reader, raster, converted.data());
+  } else {
+    const size_t rowBytes = rawRowBytes(raster);
+    if (height > remaining / rowBytes)
+      fail("truncated raster");
+    if (isRawRGB(raster)) {
+      pixels = RGBView(reinterpret_cast<const RGB *>(reader.p), width,
+                       height, rowBytes);
+      return;
+    }
+    converted.resize(width * height);
+    readRaw(reader.p, raster, rowBytes, converted.data());
+  }
+  pixels = RGBView(converted.data(), width, height, width * sizeof(RGB));
+}
+
+MappedNetpbmFile::MappedNetpbmFile(const std::string &path)
+    : file(path), image(file.data(), file.size()) {}
+
+RGBImage readNetpbm(std::istream &in) {
+  NetpbmReader reader{nullptr, nullptr, &in};
+  const Raster raster = readHeader(reader);
+  RGBImage res;
+  res.xSize = raster.width;
+  res.ySize = raster.height;
+  res.img.resize(raster.width * raster.height);
+  uint8_t *pixels = reinterpret_cast<uint8_t *>(res.img.data());
+
+  if (raster.plain) {
+    readPlain(reader, raster, res.img.data());
+  } else if (isRawRGB(raster)) {
+    reader.read(pixels, res.sizeInBytes());
+  } else {
+    std::vector<uint8_t> data(rawRowBytes(raster) * raster.height);
+    reader.read(data.data(), data.size());
+    readRaw(data.data(), raster, rawRowBytes(raster), res.img.data());
+  }
+  return res;
+}
+
+void writeNetpbm(const RGBView &image, std::ostream &out,
+                 NetpbmFormat format) {
+  const size_t rowBytes = image.xSize * sizeof(RGB);
+  switch (format) {
+  case NetpbmFormat::PGM:
+    out << "P5\n" << image.xSize << " " << image.ySize << "\n"
+        << MAX_COL - 1 << "\n";
+    break;
+  case NetpbmFormat::PPM:
+    out << "P6\n" << image.xSize << " " << image.ySize << "\n"
+        << MAX_COL - 1 << "\n";
+    break;
+  case NetpbmFormat::PAM:
+    out << "P7\nWIDTH " << image.xSize << "\nHEIGHT " << image.ySize
+        << "\nDEPTH 3\nMAXVAL " << MAX_COL - 1 << "\nTUPLTYPE RGB\nENDHDR\n";
+    break;
+  }
+
+  if (format == NetpbmFormat::PGM) {
+    std::vector<char> row(image.xSize);
+    for (size_t y = 0; y < image.ySize; y++) {
+      const RGB *src = image.row(y);
+      for (size_t x = 0; x < image.xSize; x++) {
+        const uint32_t r = (uint8_t)src[x][0], g = (uint8_t)src[x][1],
+                       b = (uint8_t)src[x][2];
+        row[x] = (char)((77 * r + 150 * g + 29 * b + 128) >> 8);
+      }
+      out.write(row.data(), row.size());
+    }
+  } else if (image.stride == rowBytes) {
+    out.write(reinterpret_cast<const char *>(image.pixels),
+              rowBytes * image.ySize);
+  } else {
+    for (size_t y = 0; y < image.ySize; y++)
+      out.write(reinterpret_cast<const char *>(image.row(y)), rowBytes);
+  }
+}
@@ -0,0 +1,174 @@
+#include "PCASearch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+// Number of leading coefficients checked before full distance
+const size_t PREFIX_SIZE = 4;
+const size_t MAX_SWEEPS = 50;
+
+// Eigenvectors of symmetric n x n matrix (row major) computed with cyclic
+// Jacobi rotations, returned as rows sorted by decreasing eigenvalue.
+static std::vector<VectorType> principalAxes(std::vector<VectorType> a,
+                                             size_t n) {
+  std::vector<VectorType> v(n * n);
+  for (size_t i = 0; i < n; i++)
+    v[i * n + i] = 1;
+
+  for (size_t sweep = 0; sweep < MAX_SWEEPS; sweep++) {
+    VectorType off = 0, diagonal = 0;
+    for (size_t p = 0; p < n; p++)
+      for (size_t q = 0; q < n; q++)
+        (p == q ? diagonal : off) += a[p * n + q] * a[p * n + q];
+    if (off <= 1e-20 * diagonal)
+      break;
+
+    for (size_t p = 0; p < n; p++)
+      for (size_t q = p + 1; q < n; q++) {
+        VectorType apq = a[p * n + q];
+        if (std::abs(apq) <= std::numeric_limits<VectorType>::min())
+          continue;
+        VectorType theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+        VectorType t = (theta >= 0 ? 1 : -1) /
+                       (std::abs(theta) + std::sqrt(theta * theta + 1));
+        VectorType c = 1 / std::sqrt(t * t + 1);
+        VectorType s = t * c;
+
+        for (size_t k = 0; k < n; k++) {
+          VectorType akp = a[k * n + p], akq = a[k * n + q];
+          a[k * n + p] = c * akp - s * akq;
+          a[k * n + q] = s * akp + c * akq;
+        }
+        for (size_t k = 0; k < n; k++) {
+          VectorType apk = a[p * n + k], aqk = a[q * n + k];
+          a[p * n + k] = c * apk - s * aqk;
+          a[q * n + k] = s * apk + c * aqk;
+        }
+        for (size_t k = 0; k < n; k++) {
+          VectorType vkp = v[k * n + p], vkq = v[k * n + q];
+          v[k * n + p] = c * vkp - s * vkq;
+          v[k * n + q] = s * vkp + c * vkq;
+        }
+      }
+  }
+
+  std::vector<size_t> byVariance(n);
+  std::iota(std::begin(byVariance), std::end(byVariance), 0);
+  std::sort(std::begin(byVariance), std::end(byVariance),
+            [&](size_t i, size_t j) { return a[i * n + i] > a[j * n + j]; });
+
+  std::vector<VectorType> res(n * n);
+  for (size_t i = 0; i < n; i++)
+    for (size_t k = 0; k < n; k++)
+      res[i * n + k] = v[k * n + byVariance[i]];
+  return res;
+}
+
+PCASearch::PCASearch(size_t dim, const std::vector<Vector> &pts)
+    : dim(dim), prefix(std::min(PREFIX_SIZE, dim)), order(pts.size()),
+      position(pts.size()) {
+  Vector mean(dim);
+  for (const auto &p : pts)
+    mean += p;
+  mean /= (VectorType)std::max<size_t>(pts.size(), 1);
+
+  std::vector<VectorType> covariance(dim * dim);
+  for (const auto &p : pts) {
+    Vector d = p - mean;
+    for (size_t i = 0; i < dim; i++)
+      for (size_t j = 0; j < dim; j++)
+        covariance[i * dim + j] += d[i] * d[j];
+  }
+  basis = principalAxes(std::move(covariance), dim);
+  basis.resize(prefix * dim);
+
+  std::vector<VectorType> unsorted(pts.size() * prefix);
+  for (size_t i = 0; i < pts.size(); i++)
+    project(&pts[i][0], &unsorted[i * prefix]);
+
+  std::iota(std::begin(order), std::end(order), 0);
+  std::sort(std::begin(order), std::end(order), [&](size_t i, size_t j) {
+    return unsorted[i * prefix] < unsorted[j * prefix];
+  });
+
+  leading.resize(unsorted.size());
+  points.resize(pts.size() * dim);
+  firstCoefficient.resize(pts.size());
+  for (size_t s = 0; s < order.size(); s++) {
+    position[order[s]] = s;
+    std::copy(&unsorted[order[s] * prefix],
+              &unsorted[order[s] * prefix] + prefix, &leading[s * prefix]);
+    std::copy(std::begin(pts[order[s]]), std::end(pts[order[s]]),
+              &points[s * dim]);
+    firstCoefficient[s] = leading[s * prefix];
+  }
+}
+
+void PCASearch::project(const VectorType *pt, VectorType *res) const {
+  for (size_t k = 0; k < prefix; k++) {
+    VectorType x = 0;
+    for (size_t j = 0; j < dim; j++)
+      x += basis[k * dim + j] * pt[j];
+    res[k] = x;
+  }
+}
+
+size_t PCASearch::nearestNeighbour(const Vector &pt) const {
+  VectorType distance;
+  return nearestNeighbour(pt, order.size(), distance);
+}
+
+size_t PCASearch::nearestNeighbour(const Vector &pt, size_t hint,
+                                   VectorType &distance) const {
+  VectorType q[PREFIX_SIZE];
+  project(&pt[0], q);
+
+  VectorType best = std::numeric_limits<VectorType>::max();
+  size_t found = 0;
+
+  auto tryCandidate = [&](size_t s) {
+    const VectorType *c = &leading[s * prefix];
+    VectorType d = 0;
+    for (size_t j = 0; j < prefix; j++)
+      d += (q[j] - c[j]) * (q[j] - c[j]);
+    if (d >= best)
+      return;
+
+    c = &points[s * dim];
+    d = 0;
+    for (size_t j = 0; j < dim; j++)
+      d += (pt[j] - c[j]) * (pt[j] - c[j]);
+    if (d < best) {
+      best = d;
+      found = s;
+    }
+  };
+
+  if (hint < position.size())
+    tryCandidate(position[hint]);
+
+  size_t up = std::lower_bound(std::begin(firstCoefficient),
+                               std::end(firstCoefficient), q[0]) -
+              std::begin(firstCoefficient);
+  size_t down = up;
+  bool goUp = true, goDown = true;
+  while (goUp || goDown) {
+    if (goUp) {
+      VectorType gap = up < order.size() ? firstCoefficient[up] - q[0] : 0;
+      goUp = up < order.size() && gap * gap < best;
+      if (goUp)
+        tryCandidate(up++);
+    }
+    if (goDown) {
+      VectorType gap = down > 0 ? q[0] - firstCoefficient[down - 1] : 0;
+      goDown = down > 0 && gap * gap < best;
+      if (goDown)
+        tryCandidate(--down);
+    }
+  }
+
+  distance = best;
+  return order[found];
+}
@@ -0,0 +1,55 @@
+#include "Png.hpp"
+
+#include <cstring>
+#include <ostream>
+#include <png.h>
+#include <stdexcept>
+#include <vector>
+
+RGBImage readPng(const uint8_t *data, size_t size) {
+  png_image image;
+  std::memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_memory(&image, data, size))
+    throw std::runtime_error(std::string("Invalid PNG file: ") +
+                             image.message);
+  image.format = PNG_FORMAT_RGB;
+
+  // Buffer starts black, alpha is composed onto it
+  RGBImage res;
+  res.xSize = image.width;
+  res.ySize = image.height;
+  res.img.resize((size_t)image.width * image.height);
+  if (!png_image_finish_read(&image, nullptr, res.img.data(), 0, nullptr))
+    throw std::runtime_error(std::string("Invalid PNG file: ") +
+                             image.message);
+  return res;
+}
+
+void writePng(const RGBView &image, std::ostream &out) {
+  png_image png;
+  std::memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  png.width = image.xSize;
+  png.height = image.ySize;
+  png.format = PNG_FORMAT_RGB;
+
+  // Raw size plus deflate overhead is almost always enough, otherwise
+  // libpng tells the size needed and image is written once more
+  const size_t rowBytes = image.xSize * sizeof(RGB) + 1;
+  png_alloc_size_t size =
+      rowBytes * image.ySize + rowBytes * image.ySize / 100 + 1024;
+  std::vector<char> buffer;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    buffer.resize(size);
+    // Stride is in components, bytes for 8 bit ones
+    if (png_image_write_to_memory(&png, buffer.data(), &size, 0,
+                                  image.pixels, image.stride, nullptr)) {
+      out.write(buffer.data(), size);
+      return;
+    }
+    if (size <= buffer.size())
+      break;
+  }
+  throw std::runtime_error(std::string("Cannot encode PNG: ") + png.message);
+}
@@ -0,0 +1,172 @@
+#include "Qoi.hpp"
+
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+// Chunk tags, 2 bit ones are told apart by top bits of the byte
+const static uint8_t QOI_OP_INDEX = 0x00;
+const static uint8_t QOI_OP_DIFF = 0x40;
+const static uint8_t QOI_OP_LUMA = 0x80;
+const static uint8_t QOI_OP_RUN = 0xc0;
+const static uint8_t QOI_OP_RGB = 0xfe;
+const static uint8_t QOI_OP_RGBA = 0xff;
+const static uint8_t QOI_MASK = 0xc0;
+
+const static size_t QOI_HEADER_SIZE = 14;
+const static uint8_t QOI_END[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+// Limit of reference implementation, guards against absurd headers
+const static uint64_t QOI_MAX_PIXELS = 400000000;
+
+struct QoiPixel {
+  uint8_t r = 0, g = 0, b = 0, a = 0;
+  bool operator==(const QoiPixel &o) const {
+    return r == o.r && g == o.g && b == o.b && a == o.a;
+  }
+  size_t hash() const { return (r * 3 + g * 5 + b * 7 + a * 11) % 64; }
+};
+
+static uint32_t readBigEndian(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void writeBigEndian(uint32_t v, std::vector<uint8_t> &out) {
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out.push_back((uint8_t)(v >> shift));
+}
+
+[[noreturn]] static void fail(const std::string &what) {
+  throw std::runtime_error("Invalid QOI file: " + what);
+}
+
+RGBImage readQoi(const uint8_t *data, size_t size) {
+  if (size < QOI_HEADER_SIZE + sizeof(QOI_END) ||
+      std::memcmp(data, "qoif", 4) != 0)
+    throw std::runtime_error("Not a QOI file");
+  const uint32_t width = readBigEndian(data + 4);
+  const uint32_t height = readBigEndian(data + 8);
+  const uint8_t channels = data[12];
+  if (width == 0 || height == 0 ||
+      (uint64_t)width * height > QOI_MAX_PIXELS)
+    fail("bad dimensions");
+  if (channels != 3 && channels != 4)
+    fail("bad channel count");
+
+  RGBImage res;
+  res.xSize = width;
+  res.ySize = height;
+  res.img.resize((size_t)width * height);
+
+  QoiPixel index[64];
+  QoiPixel px;
+  px.a = 255;
+  const uint8_t *p = data + QOI_HEADER_SIZE;
+  const uint8_t *end = data + size - sizeof(QOI_END);
+  size_t run = 0;
+  for (RGB &out : res.img) {
+    if (run) {
+      run--;
+    } else {
+      if (p >= end)
+        fail("truncated data");
+      const uint8_t tag = *p++;
+      if (tag == QOI_OP_RGB || tag == QOI_OP_RGBA) {
+        const size_t n = tag == QOI_OP_RGB ? 3 : 4;
+        if ((size_t)(end - p) < n)
+          fail("truncated data");
+        px.r = p[0];
+        px.g = p[1];
+        px.b = p[2];
+        if (n == 4)
+          px.a = p[3];
+        p += n;
+      } else if ((tag & QOI_MASK) == QOI_OP_INDEX) {
+        px = index[tag];
+      } else if ((tag & QOI_MASK) == QOI_OP_DIFF) {
+        px.r += ((tag >> 4) & 3) - 2;
+        px.g += ((tag >> 2) & 3) - 2;
+        px.b += (tag & 3) - 2;
+      } else if ((tag & QOI_MASK) == QOI_OP_LUMA) {
+        if (p == end)
+          fail("truncated data");
+        const uint8_t next = *p++;
+        const int dg = (tag & 0x3f) - 32;
+        px.r += dg - 8 + ((next >> 4) & 0x0f);
+        px.g += dg;
+        px.b += dg - 8 + (next & 0x0f);
+      } else {
+        run = tag & 0x3f;
+      }
+      index[px.hash()] = px;
+    }
+    out = {(char)px.r, (char)px.g, (char)px.b};
+  }
+  return res;
+}
+
+void writeQoi(const RGBView &image, std::ostream &out) {
+  std::vector<uint8_t> res;
+  res.reserve(QOI_HEADER_SIZE + image.xSize * image.ySize * 4 / 3 +
+              sizeof(QOI_END));
+  res.insert(std::end(res), {'q', 'o', 'i', 'f'});
+  writeBigEndian(image.xSize, res);
+  writeBigEndian(image.ySize, res);
+  res.push_back(3);
+  // sRGB with linear alpha
+  res.push_back(0);
+
+  QoiPixel index[64];
+  QoiPixel prev;
+  prev.a = 255;
+  size_t run = 0;
+  for (size_t y = 0; y < image.ySize; y++) {
+    const RGB *row = image.row(y);
+    for (size_t x = 0; x < image.xSize; x++) {
+      QoiPixel px;
+      px.r = row[x][0];
+      px.g = row[x][1];
+      px.b = row[x][2];
+      px.a = 255;
+      if (px == prev) {
+        // Runs of 63 and 64 would collide with RGB and RGBA tags
+        if (++run == 62) {
+          res.push_back(QOI_OP_RUN | (run - 1));
+          run = 0;
+        }
+        continue;
+      }
+      if (run) {
+        res.push_back(QOI_OP_RUN | (run - 1));
+        run = 0;
+      }
+
+      const size_t slot = px.hash();
+      if (index[slot] == px) {
+        res.push_back(QOI_OP_INDEX | slot);
+      } else {
+        index[slot] = px;
+        const int8_t dr = px.r - prev.r, dg = px.g - prev.g,
+                     db = px.b - prev.b;
+        const int8_t drg = dr - dg, dbg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+            db <= 1) {
+          res.push_back(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 |
+                        (db + 2));
+        } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 &&
+                   dbg >= -8 && dbg <= 7) {
+          res.push_back(QOI_OP_LUMA | (dg + 32));
+          res.push_back((drg + 8) << 4 | (dbg + 8));
+        } else {
+          res.insert(std::end(res), {QOI_OP_RGB, px.r, px.g, px.b});
+        }
+      }
+      prev = px;
+    }
+  }
+  if (run)
+    res.push_back(QOI_OP_RUN | (run - 1));
+  res.insert(std::end(res), std::begin(QOI_END), std::end(QOI_END));
+  out.write(reinterpret_cast<const char *>(res.data()), res.size());
+}
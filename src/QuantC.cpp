@@ -0,0 +1,173 @@
+#include "QuantC.h"
+#include "Compressor.hpp"
+#include "QuantFormat.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Exceptions must not cross the C boundary, they are turned into status.
+// Malformed .quant data is reported by QuantView as runtime_error.
+template <typename F> static quant_status guarded(const F &f) {
+  try {
+    f();
+    return QUANT_OK;
+  } catch (const std::bad_alloc &) {
+    return QUANT_OUT_OF_MEMORY;
+  } catch (const std::invalid_argument &) {
+    return QUANT_INVALID_ARGUMENT;
+  } catch (const std::out_of_range &) {
+    return QUANT_INVALID_ARGUMENT;
+  } catch (const std::runtime_error &) {
+    return QUANT_CORRUPT_DATA;
+  } catch (...) {
+    return QUANT_INTERNAL_ERROR;
+  }
+}
+
+// OpenMP team size of calling thread for the duration of a call
+class ThreadSetting {
+ public:
+  explicit ThreadSetting(int threads) {
+#ifdef _OPENMP
+    previous = omp_get_max_threads();
+    if (threads > 0)
+      omp_set_num_threads(threads);
+#endif
+  }
+  ~ThreadSetting() {
+#ifdef _OPENMP
+    omp_set_num_threads(previous);
+#endif
+  }
+
+ private:
+  int previous = 0;
+};
+
+// Largest block side accepted, vectors of bigger blocks are useless
+const uint32_t MAX_BLOCK_SIDE = 256;
+
+// Everything training could fail on has to be caught here, allocation
+// inside OpenMP regions terminates instead of reaching guarded()
+static bool validOptions(const quant_options &options) {
+  return options.color_space >= QUANT_NORMAL &&
+         options.color_space <= QUANT_YCBCR420 && options.block_width > 0 &&
+         options.block_width <= MAX_BLOCK_SIDE && options.block_height > 0 &&
+         options.block_height <= MAX_BLOCK_SIDE &&
+         options.bits <= QUANT_MAX_INDEX_BITS &&
+         options.code_vectors <= ((uint64_t)1 << QUANT_MAX_INDEX_BITS) &&
+         options.eps >= 0;
+}
+
+void quant_default_options(quant_options *options) {
+  options->color_space = QUANT_SCALED;
+  options->block_width = 2;
+  options->block_height = 2;
+  options->bits = 8;
+  options->code_vectors = 0;
+  options->eps = 0.000001;
+  options->progressive = 0;
+  options->threads = 0;
+}
+
+quant_status quant_compress(const uint8_t *pixels, size_t width,
+                            size_t height, size_t stride,
+                            const quant_options *options, uint8_t **out,
+                            size_t *out_size, quant_stats *stats) {
+  if (!pixels || !options || !out || !out_size || width == 0 ||
+      height == 0 || stride < width * sizeof(RGB) || !validOptions(*options))
+    return QUANT_INVALID_ARGUMENT;
+
+  return guarded([&]() {
+    ThreadSetting threads(options->threads);
+    CompressionParameters parameters;
+    parameters.codeVectors = options->code_vectors;
+    parameters.progressive = options->progressive != 0;
+    RGBView image(reinterpret_cast<const RGB *>(pixels), width, height,
+                  stride);
+    auto compressed = CompressedImage::compress(
+        image, Quantizers::LBG, (ColorSpaces)options->color_space,
+        options->block_width, options->block_height, options->eps,
+        options->bits, parameters);
+
+    std::ostringstream stream;
+    compressed.first.save(stream);
+    const std::string data = stream.str();
+    uint8_t *res = static_cast<uint8_t *>(std::malloc(data.size()));
+    if (!res)
+      throw std::bad_alloc();
+    std::memcpy(res, data.data(), data.size());
+    *out = res;
+    *out_size = data.size();
+    if (stats) {
+      stats->psnr = compressed.second.psnr;
+      stats->ssim = compressed.second.ssim;
+      stats->bits_per_pixel = compressed.second.bitsPerPixel;
+    }
+  });
+}
+
+quant_status quant_get_info(const uint8_t *data, size_t size,
+                            quant_info *info) {
+  if (!data || !info)
+    return QUANT_INVALID_ARGUMENT;
+  return guarded([&]() {
+    QuantView view(data, size);
+    const QuantHeader &head = view.header();
+    // QuantView rejects images wider or taller than 32 bits hold
+    info->width = head.xSize;
+    info->height = head.ySize;
+    info->color_space = (quant_color_space)head.colorSpace;
+    info->block_width = head.blockWidth;
+    info->block_height = head.blockHeight;
+  });
+}
+
+quant_status quant_decompress(const uint8_t *data, size_t size,
+                              uint8_t *pixels, size_t stride) {
+  if (!data || !pixels)
+    return QUANT_INVALID_ARGUMENT;
+  return guarded([&]() {
+    QuantView view(data, size);
+    if (stride < view.header().xSize * sizeof(RGB))
+      throw std::invalid_argument("Stride shorter than image row");
+    view.decompressRegion(0, 0, view.header().xSize, view.header().ySize,
+                          reinterpret_cast<RGB *>(pixels), stride);
+  });
+}
+
+quant_status quant_decompress_region(const uint8_t *data, size_t size,
+                                     size_t x, size_t y, size_t w, size_t h,
+                                     uint8_t *pixels, size_t stride) {
+  if (!data || !pixels || stride < w * sizeof(RGB))
+    return QUANT_INVALID_ARGUMENT;
+  return guarded([&]() {
+    QuantView(data, size).decompressRegion(
+        x, y, w, h, reinterpret_cast<RGB *>(pixels), stride);
+  });
+}
+
+void quant_free(uint8_t *data) { std::free(data); }
+
+const char *quant_status_string(quant_status status) {
+  switch (status) {
+  case QUANT_OK:
+    return "ok";
+  case QUANT_INVALID_ARGUMENT:
+    return "invalid argument";
+  case QUANT_CORRUPT_DATA:
+    return "corrupt .quant data";
+  case QUANT_OUT_OF_MEMORY:
+    return "out of memory";
+  case QUANT_INTERNAL_ERROR:
+    return "internal error";
+  }
+  return "unknown status";
+}
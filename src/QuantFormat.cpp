@@ -0,0 +1,600 @@
+#include "QuantFormat.hpp"
+#include "BitPacking.hpp"
+#include "ContextCoding.hpp"
+#include "EntropyCoding.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <ostream>
+#include <stdexcept>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error ".quant headers are read and written as little endian structs"
+#endif
+
+template <typename T> static T alignUp(T x, size_t a) {
+  return (x + a - 1) / a * a;
+}
+
+// Geometry of sections as implied by image header
+static size_t sectionCount(ColorSpaces colorSpace) {
+  return colorSpace == ColorSpaces::YCBCR420 ? 2 : 1;
+}
+
+static void sectionGeometry(const QuantHeader &head, size_t section,
+                            uint64_t &codeVectorSize, uint64_t &gridWidth,
+                            uint64_t &gridHeight) {
+  uint64_t xSize = head.xSize, ySize = head.ySize, channels = 3;
+  if ((ColorSpaces)head.colorSpace == ColorSpaces::YCBCR420) {
+    channels = section ? 2 : 1;
+    if (section) {
+      xSize = (xSize + 1) / 2;
+      ySize = (ySize + 1) / 2;
+    }
+  }
+  codeVectorSize = (uint64_t)head.blockWidth * head.blockHeight * channels;
+  gridWidth = (xSize + head.blockWidth - 1) / head.blockWidth;
+  gridHeight = (ySize + head.blockHeight - 1) / head.blockHeight;
+}
+
+static std::vector<uint8_t>
+rawCodebook(const std::vector<CharVector> &codeVectors) {
+  std::vector<uint8_t> res;
+  for (const auto &c : codeVectors)
+    res.insert(std::end(res), std::begin(c), std::end(c));
+  return res;
+}
+
+static std::vector<uint8_t>
+deltaCodedCodebook(const std::vector<CharVector> &codeVectors) {
+  std::vector<uint32_t> deltas;
+  for (size_t k = 0; k < codeVectors.size(); k++)
+    for (size_t j = 0; j < codeVectors[k].size(); j++)
+      deltas.push_back((uint8_t)(codeVectors[k][j] -
+                                 (k ? codeVectors[k - 1][j] : (char)0)));
+
+  std::vector<uint8_t> res;
+  ransEncode(deltas, MAX_COL, res);
+  return res;
+}
+
+static size_t tilesAcross(uint64_t blocks, uint32_t tileSize) {
+  return (blocks + tileSize - 1) / tileSize;
+}
+
+// Product of header fields sizing a buffer, which has to stay addressable
+static uint64_t checkedProduct(uint64_t a, uint64_t b) {
+  const uint64_t limit = PTRDIFF_MAX;
+  if (b && a > limit / b)
+    throw std::runtime_error("Invalid .quant sizes");
+  return a * b;
+}
+
+// Offset table followed by tiles of the grid, every tile coded with
+// `encode(indices, width, out)`
+template <typename Encode>
+static std::vector<uint8_t>
+encodeTiles(const std::vector<size_t> &assigned, const SectionHeader &header,
+            const Encode &encode) {
+  const size_t tilesX = tilesAcross(header.gridWidth, header.tileWidth);
+  const size_t tilesY = tilesAcross(header.gridHeight, header.tileHeight);
+  std::vector<uint64_t> offsets(tilesX * tilesY + 1);
+  std::vector<uint8_t> res(offsets.size() * sizeof(uint64_t));
+
+  std::vector<size_t> tile;
+  for (size_t ty = 0; ty < tilesY; ty++)
+    for (size_t tx = 0; tx < tilesX; tx++) {
+      const size_t x0 = tx * header.tileWidth, y0 = ty * header.tileHeight;
+      const size_t x1 = std::min<size_t>(x0 + header.tileWidth, header.gridWidth);
+      const size_t y1 = std::min<size_t>(y0 + header.tileHeight, header.gridHeight);
+      tile.clear();
+      for (size_t y = y0; y < y1; y++)
+        tile.insert(std::end(tile), &assigned[y * header.gridWidth + x0],
+                    &assigned[y * header.gridWidth + x1]);
+      offsets[ty * tilesX + tx] = res.size();
+      encode(tile, x1 - x0, res);
+    }
+  offsets.back() = res.size();
+  std::memcpy(res.data(), offsets.data(), offsets.size() * sizeof(uint64_t));
+  return res;
+}
+
+// Section data and its header, every part takes the smallest coding
+struct SectionData {
+  SectionHeader header;
+  std::vector<uint8_t> codebook;
+  std::vector<uint8_t> indices;
+  // Bit-planes of progressive section, indices hold table of their offsets
+  std::vector<std::vector<uint8_t>> planes;
+};
+
+static SectionData encodeSection(const std::vector<CharVector> &codeVectors,
+                                 const std::vector<size_t> &assigned,
+                                 uint64_t codeVectorSize, uint64_t gridWidth,
+                                 uint64_t gridHeight, bool progressive) {
+  if (bitsPerIndex(codeVectors.size()) > QUANT_MAX_INDEX_BITS)
+    throw std::invalid_argument("Too many codevectors to store");
+  if (assigned.size() != gridWidth * gridHeight)
+    throw std::invalid_argument("Indices do not match image size");
+
+  SectionData res;
+  SectionHeader &header = res.header;
+  std::memset(&header, 0, sizeof(header));
+  header.codeVectors = codeVectors.size();
+  header.codeVectorSize = codeVectorSize;
+  header.gridWidth = gridWidth;
+  header.gridHeight = gridHeight;
+  header.tileWidth = QUANT_TILE_BLOCKS;
+  header.tileHeight = QUANT_TILE_BLOCKS;
+
+  header.codebookCoding = (uint32_t)CodebookCoding::RAW;
+  res.codebook = rawCodebook(codeVectors);
+  auto delta = deltaCodedCodebook(codeVectors);
+  if (delta.size() < res.codebook.size()) {
+    header.codebookCoding = (uint32_t)CodebookCoding::DELTA_RANS;
+    res.codebook = std::move(delta);
+  }
+
+  if (progressive) {
+    // Planes are coded over whole grid, there is one tile
+    const unsigned bits = bitsPerIndex(codeVectors.size());
+    header.indexCoding = (uint32_t)IndexCoding::PROGRESSIVE;
+    header.tileWidth = gridWidth;
+    header.tileHeight = gridHeight;
+    res.planes.resize(bits);
+    for (unsigned plane = 0; plane < bits; plane++)
+      encodeIndexPlane(assigned, gridWidth, bits, plane, res.planes[plane]);
+    res.indices.resize(bits * 2 * sizeof(uint64_t));
+    header.codebookSize = res.codebook.size();
+    header.indexSize = res.indices.size();
+    return res;
+  }
+
+  header.indexCoding = (uint32_t)IndexCoding::PACKED;
+  res.indices = packBits(assigned, bitsPerIndex(codeVectors.size()));
+  auto consider = [&](IndexCoding coding, std::vector<uint8_t> data) {
+    if (data.size() < res.indices.size()) {
+      header.indexCoding = (uint32_t)coding;
+      res.indices = std::move(data);
+    }
+  };
+  const size_t n = codeVectors.size();
+  if (n <= RANS_MAX_ALPHABET)
+    consider(IndexCoding::RANS,
+             encodeTiles(assigned, header,
+                         [&](const std::vector<size_t> &tile, size_t,
+                             std::vector<uint8_t> &out) {
+                           ransEncode(std::vector<uint32_t>(std::begin(tile),
+                                                            std::end(tile)),
+                                      n, out);
+                         }));
+  consider(IndexCoding::CONTEXT,
+           encodeTiles(assigned, header,
+                       [&](const std::vector<size_t> &tile, size_t width,
+                           std::vector<uint8_t> &out) {
+                         encodeIndexGrid(tile, width, n, out);
+                       }));
+
+  header.codebookSize = res.codebook.size();
+  header.indexSize = res.indices.size();
+  return res;
+}
+
+void writeQuantFile(const CompressedImage &image, std::ostream &file) {
+  QuantHeader head;
+  std::memset(&head, 0, sizeof(head));
+  std::memcpy(head.magic, QUANT_MAGIC, sizeof(head.magic));
+  head.version = QUANT_VERSION;
+  head.colorSpace = (uint32_t)image.colorSpace;
+  head.xSize = image.xSize;
+  head.ySize = image.ySize;
+  head.blockWidth = image.blockWidth;
+  head.blockHeight = image.blockHeight;
+  head.sections = sectionCount(image.colorSpace);
+
+  std::vector<SectionData> sections;
+  for (size_t i = 0; i < head.sections; i++) {
+    uint64_t codeVectorSize, gridWidth, gridHeight;
+    sectionGeometry(head, i, codeVectorSize, gridWidth, gridHeight);
+    sections.push_back(
+        i ? encodeSection(image.chromaCodeVectors,
+                          image.chromaAssignedCodeVector, codeVectorSize,
+                          gridWidth, gridHeight, image.progressive)
+          : encodeSection(image.codeVectors, image.assignedCodeVector,
+                          codeVectorSize, gridWidth, gridHeight,
+                          image.progressive));
+  }
+
+  // Every part starts aligned and has a word of padding after it. Parts
+  // are written in order of placement.
+  uint64_t offset = sizeof(QuantHeader) + sections.size() * sizeof(SectionHeader);
+  std::vector<const std::vector<uint8_t> *> parts;
+  std::vector<uint64_t> partOffsets;
+  auto place = [&](const std::vector<uint8_t> &part) {
+    uint64_t res = alignUp(offset, QUANT_ALIGNMENT);
+    offset = res + part.size() + sizeof(uint64_t);
+    parts.push_back(&part);
+    partOffsets.push_back(res);
+    return res;
+  };
+  if (!image.progressive) {
+    for (auto &section : sections) {
+      section.header.codebookOffset = place(section.codebook);
+      section.header.indexOffset = place(section.indices);
+    }
+  } else {
+    // Codebooks and plane tables go first, then planes of all sections
+    // interleaved coarse to fine, so every prefix of the file is usable
+    for (auto &section : sections)
+      section.header.codebookOffset = place(section.codebook);
+    for (auto &section : sections)
+      section.header.indexOffset = place(section.indices);
+    offset = alignUp(offset, QUANT_ALIGNMENT);
+    for (size_t plane = 0;; plane++) {
+      bool any = false;
+      for (auto &section : sections) {
+        if (plane >= section.planes.size())
+          continue;
+        uint64_t range[2] = {offset, offset + section.planes[plane].size()};
+        std::memcpy(&section.indices[plane * sizeof(range)], range,
+                    sizeof(range));
+        parts.push_back(&section.planes[plane]);
+        partOffsets.push_back(offset);
+        offset = range[1];
+        any = true;
+      }
+      if (!any)
+        break;
+    }
+    offset += sizeof(uint64_t);
+  }
+  const uint64_t fileSize = alignUp(offset, QUANT_ALIGNMENT);
+
+  uint64_t written = 0;
+  auto write = [&](const void *data, size_t size) {
+    file.write(static_cast<const char *>(data), size);
+    written += size;
+  };
+  auto padTo = [&](uint64_t position) {
+    static const char zeros[QUANT_ALIGNMENT] = {};
+    while (written < position)
+      write(zeros, std::min<uint64_t>(position - written, sizeof(zeros)));
+  };
+
+  write(&head, sizeof(head));
+  for (const auto &section : sections)
+    write(&section.header, sizeof(section.header));
+  for (size_t k = 0; k < parts.size(); k++) {
+    padTo(partOffsets[k]);
+    write(parts[k]->data(), parts[k]->size());
+  }
+  padTo(fileSize);
+}
+
+QuantView::QuantView(const uint8_t *data, size_t size)
+    : data(data), size(size) {
+  if (size < sizeof(QuantHeader))
+    throw std::runtime_error("Truncated .quant header");
+  std::memcpy(&head, data, sizeof(head));
+  if (std::memcmp(head.magic, QUANT_MAGIC, sizeof(head.magic)) != 0)
+    throw std::runtime_error("Not a .quant file");
+  if (head.version != QUANT_VERSION)
+    throw std::runtime_error("Unsupported .quant version");
+  if (head.colorSpace > (uint32_t)ColorSpaces::YCBCR420 ||
+      head.sections != sectionCount((ColorSpaces)head.colorSpace) ||
+      head.blockWidth == 0 || head.blockHeight == 0 || head.xSize == 0 ||
+      head.ySize == 0 || head.xSize > UINT32_MAX || head.ySize > UINT32_MAX)
+    throw std::runtime_error("Invalid .quant header");
+  checkedProduct(checkedProduct(head.xSize, head.ySize), sizeof(RGB));
+  checkedProduct(checkedProduct(head.blockWidth, head.blockHeight), 3);
+
+  size_t tableEnd = sizeof(QuantHeader) + head.sections * sizeof(SectionHeader);
+  if (size < tableEnd)
+    throw std::runtime_error("Truncated .quant section table");
+  sectionHeaders.resize(head.sections);
+  std::memcpy(sectionHeaders.data(), data + sizeof(QuantHeader),
+              head.sections * sizeof(SectionHeader));
+
+  for (size_t i = 0; i < sectionHeaders.size(); i++) {
+    const SectionHeader &section = sectionHeaders[i];
+    uint64_t codeVectorSize, gridWidth, gridHeight;
+    sectionGeometry(head, i, codeVectorSize, gridWidth, gridHeight);
+    auto fits = [&](uint64_t offset, uint64_t length) {
+      return offset <= size && length <= size - offset &&
+             sizeof(uint64_t) <= size - offset - length;
+    };
+    if (section.codeVectorSize != codeVectorSize ||
+        section.gridWidth != gridWidth || section.gridHeight != gridHeight ||
+        section.codeVectors == 0 ||
+        section.codeVectors > ((uint64_t)1 << QUANT_MAX_INDEX_BITS) ||
+        section.tileWidth == 0 || section.tileHeight == 0 ||
+        section.codebookCoding > (uint32_t)CodebookCoding::DELTA_RANS ||
+        section.indexCoding > (uint32_t)IndexCoding::PROGRESSIVE ||
+        !fits(section.codebookOffset, section.codebookSize) ||
+        !fits(section.indexOffset, section.indexSize))
+      throw std::runtime_error("Invalid .quant section");
+    if ((IndexCoding)section.indexCoding == IndexCoding::RANS &&
+        section.codeVectors > RANS_MAX_ALPHABET)
+      throw std::runtime_error("Invalid .quant section");
+    // Tiles of progressive section cover whole grid
+    if (section.tileWidth > std::max<uint64_t>(gridWidth, QUANT_TILE_BLOCKS) ||
+        section.tileHeight >
+            std::max<uint64_t>(gridHeight, QUANT_TILE_BLOCKS))
+      throw std::runtime_error("Invalid .quant tile size");
+    const uint64_t codebookBytes =
+        checkedProduct(section.codeVectors, codeVectorSize);
+    if ((CodebookCoding)section.codebookCoding == CodebookCoding::RAW &&
+        section.codebookSize != codebookBytes)
+      throw std::runtime_error("Invalid .quant codebook size");
+    const uint64_t blocks = checkedProduct(gridWidth, gridHeight);
+    checkedProduct(blocks, sizeof(size_t));
+    const uint64_t tiles = tilesAcross(gridWidth, section.tileWidth) *
+                           tilesAcross(gridHeight, section.tileHeight);
+    const size_t bits = bitsPerIndex(section.codeVectors);
+    bool validIndexSize;
+    switch ((IndexCoding)section.indexCoding) {
+    case IndexCoding::PACKED:
+      checkedProduct(blocks, bits);
+      validIndexSize = section.indexSize == packedSize(blocks, bits);
+      break;
+    case IndexCoding::PROGRESSIVE:
+      validIndexSize = section.indexSize == bits * 2 * sizeof(uint64_t);
+      break;
+    default:
+      validIndexSize =
+          section.indexSize >= checkedProduct(tiles + 1, sizeof(uint64_t));
+    }
+    if (!validIndexSize)
+      throw std::runtime_error("Invalid .quant index size");
+  }
+}
+
+const char *QuantView::codebook(size_t i, std::vector<char> &storage) const {
+  const SectionHeader &section = sectionHeaders[i];
+  const uint8_t *codebook = data + section.codebookOffset;
+  if ((CodebookCoding)section.codebookCoding == CodebookCoding::RAW)
+    return reinterpret_cast<const char *>(codebook);
+
+  const size_t dim = section.codeVectorSize;
+  size_t pos = 0;
+  auto deltas = ransDecode(codebook, section.codebookSize, pos,
+                           section.codeVectors * dim, MAX_COL);
+  storage.resize(deltas.size());
+  for (size_t k = 0; k < deltas.size(); k++)
+    storage[k] = (char)(deltas[k] + (k >= dim ? storage[k - dim] : (char)0));
+  return storage.data();
+}
+
+std::vector<size_t> QuantView::tile(size_t i, size_t k) const {
+  const SectionHeader &section = sectionHeaders[i];
+  const uint8_t *indices = data + section.indexOffset;
+  const size_t tilesX = tilesAcross(section.gridWidth, section.tileWidth);
+  const size_t tilesY = tilesAcross(section.gridHeight, section.tileHeight);
+  const size_t tx = k % tilesX, ty = k / tilesX;
+  const size_t width = std::min<size_t>(section.tileWidth,
+                                        section.gridWidth - tx * section.tileWidth);
+  const size_t height = std::min<size_t>(
+      section.tileHeight, section.gridHeight - ty * section.tileHeight);
+
+  uint64_t begin, end;
+  std::memcpy(&begin, indices + k * sizeof(uint64_t), sizeof(begin));
+  std::memcpy(&end, indices + (k + 1) * sizeof(uint64_t), sizeof(end));
+  if (begin < (tilesX * tilesY + 1) * sizeof(uint64_t) || begin > end ||
+      end > section.indexSize)
+    throw std::runtime_error("Invalid .quant tile offset");
+
+  std::vector<size_t> res;
+  size_t pos = 0;
+  if ((IndexCoding)section.indexCoding == IndexCoding::RANS) {
+    auto decoded = ransDecode(indices + begin, end - begin, pos,
+                              width * height, section.codeVectors);
+    res.assign(std::begin(decoded), std::end(decoded));
+  } else {
+    res = decodeIndexGrid(indices + begin, end - begin, pos, width * height,
+                          width, section.codeVectors);
+  }
+  for (size_t index : res)
+    if (index >= section.codeVectors)
+      throw std::runtime_error("Invalid .quant codevector index");
+  return res;
+}
+
+size_t QuantView::planes(size_t i) const {
+  const SectionHeader &section = sectionHeaders[i];
+  if ((IndexCoding)section.indexCoding != IndexCoding::PROGRESSIVE)
+    return bitsPerIndex(section.codeVectors);
+
+  // Planes are present up to the first one cut off by end of data
+  const uint8_t *table = data + section.indexOffset;
+  size_t res = 0;
+  for (; res < section.indexSize / (2 * sizeof(uint64_t)); res++) {
+    uint64_t range[2];
+    std::memcpy(range, table + res * sizeof(range), sizeof(range));
+    if (range[0] > range[1] || range[1] > size)
+      break;
+  }
+  return res;
+}
+
+// Codebook of tree nodes `planes` deep, each is mean of leaves under it
+static std::vector<char> ancestorCodebook(const char *codeVectors, size_t n,
+                                          size_t dim, unsigned bits,
+                                          unsigned planes) {
+  const size_t leaves = (size_t)1 << (bits - planes);
+  std::vector<char> res(dim << planes);
+  for (size_t node = 0; node < ((size_t)1 << planes); node++) {
+    const size_t begin = node * leaves, end = std::min(begin + leaves, n);
+    for (size_t j = 0; begin < end && j < dim; j++) {
+      size_t sum = 0;
+      for (size_t k = begin; k < end; k++)
+        sum += (uint8_t)codeVectors[k * dim + j];
+      res[node * dim + j] = (char)((sum + (end - begin) / 2) / (end - begin));
+    }
+  }
+  return res;
+}
+
+CodebookSource QuantView::source(size_t i, size_t blockXBegin,
+                                 size_t blockYBegin, size_t blockXEnd,
+                                 size_t blockYEnd,
+                                 std::vector<char> &codebookStorage,
+                                 std::vector<size_t> &indexStorage) const {
+  const SectionHeader &section = sectionHeaders[i];
+  CodebookSource res;
+  res.codeVectors = codebook(i, codebookStorage);
+  if ((IndexCoding)section.indexCoding == IndexCoding::PACKED) {
+    res.packedIndices = data + section.indexOffset;
+    res.bitsPerIndex = bitsPerIndex(section.codeVectors);
+    return res;
+  }
+
+  if ((IndexCoding)section.indexCoding == IndexCoding::PROGRESSIVE) {
+    // Available planes are decoded for whole grid, missing ones make
+    // indices point to ancestors of codevectors
+    const unsigned bits = bitsPerIndex(section.codeVectors);
+    const unsigned available = planes(i);
+    const uint8_t *table = data + section.indexOffset;
+    indexStorage.assign(section.gridWidth * section.gridHeight, 0);
+    for (unsigned plane = 0; plane < available; plane++) {
+      uint64_t range[2];
+      std::memcpy(range, table + plane * sizeof(range), sizeof(range));
+      decodeIndexPlane(data + range[0], range[1] - range[0],
+                       section.gridWidth, plane, indexStorage);
+    }
+    if (available < bits) {
+      std::vector<char> ancestors =
+          ancestorCodebook(res.codeVectors, section.codeVectors,
+                           section.codeVectorSize, bits, available);
+      codebookStorage = std::move(ancestors);
+      res.codeVectors = codebookStorage.data();
+    } else {
+      for (size_t index : indexStorage)
+        if (index >= section.codeVectors)
+          throw std::runtime_error("Invalid .quant codevector index");
+    }
+    res.indices = indexStorage.data();
+    return res;
+  }
+
+  const size_t tw = section.tileWidth, th = section.tileHeight;
+  const size_t tilesX = tilesAcross(section.gridWidth, section.tileWidth);
+  const size_t txBegin = blockXBegin / tw, txEnd = (blockXEnd + tw - 1) / tw;
+  const size_t tyBegin = blockYBegin / th, tyEnd = (blockYEnd + th - 1) / th;
+  res.blockX = txBegin * tw;
+  res.blockY = tyBegin * th;
+  res.stride = std::min<size_t>(txEnd * tw, section.gridWidth) - res.blockX;
+  indexStorage.resize(
+      res.stride * (std::min<size_t>(tyEnd * th, section.gridHeight) - res.blockY));
+
+  // Tiles are independent, they are entropy decoded in parallel. Errors
+  // can not leave parallel region, first one is rethrown after it.
+  const size_t tilesAcrossWindow = txEnd - txBegin;
+  const ptrdiff_t tiles = tilesAcrossWindow * (tyEnd - tyBegin);
+  std::exception_ptr error;
+  #pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t k = 0; k < tiles; k++) {
+    const size_t tx = txBegin + k % tilesAcrossWindow;
+    const size_t ty = tyBegin + k / tilesAcrossWindow;
+    try {
+      const std::vector<size_t> indices = tile(i, ty * tilesX + tx);
+      const size_t width = std::min<size_t>(tw, section.gridWidth - tx * tw);
+      size_t *dst = &indexStorage[(ty * th - res.blockY) * res.stride +
+                                  tx * tw - res.blockX];
+      for (size_t y = 0; y < indices.size() / width; y++)
+        std::copy(&indices[y * width], &indices[y * width] + width,
+                  dst + y * res.stride);
+    } catch (...) {
+      #pragma omp critical
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+  res.indices = indexStorage.data();
+  return res;
+}
+
+CodebookSource QuantView::source(size_t i, std::vector<char> &codebookStorage,
+                                 std::vector<size_t> &indexStorage) const {
+  return source(i, 0, 0, sectionHeaders[i].gridWidth,
+                sectionHeaders[i].gridHeight, codebookStorage, indexStorage);
+}
+
+RGBImage QuantView::decompress() const {
+  return decompressRegion(0, 0, head.xSize, head.ySize);
+}
+
+RGBImage QuantView::decompressRegion(size_t x, size_t y, size_t w,
+                                     size_t h) const {
+  RGBImage img;
+  img.xSize = w;
+  img.ySize = h;
+  img.img.resize(w * h);
+  decompressRegion(x, y, w, h, img.img.data());
+  return img;
+}
+
+void QuantView::decompressRegion(size_t x, size_t y, size_t w, size_t h,
+                                 RGB *out, size_t stride) const {
+  if (w == 0 || h == 0 || x + w > head.xSize || y + h > head.ySize ||
+      x + w < x || y + h < y)
+    throw std::out_of_range("Region outside of image");
+
+  // Plane coordinates of the region, chroma of 4:2:0 has half resolution
+  size_t xBegin[2] = {x, x / 2}, yBegin[2] = {y, y / 2};
+  size_t xEnd[2] = {x + w, (x + w + 1) / 2}, yEnd[2] = {y + h, (y + h + 1) / 2};
+
+  std::vector<char> codebooks[2];
+  std::vector<size_t> indices[2];
+  CodebookSource sources[2];
+  const size_t bw = head.blockWidth, bh = head.blockHeight;
+  for (size_t i = 0; i < sections(); i++)
+    sources[i] = source(i, xBegin[i] / bw, yBegin[i] / bh,
+                        (xEnd[i] + bw - 1) / bw, (yEnd[i] + bh - 1) / bh,
+                        codebooks[i], indices[i]);
+
+  decodeRegion((ColorSpaces)head.colorSpace, head.xSize, bw, bh, sources[0],
+               sources[1], x, y, x + w, y + h, out, stride);
+}
+
+CompressedImage QuantView::toCompressedImage() const {
+  CompressedImage res;
+  res.xSize = head.xSize;
+  res.ySize = head.ySize;
+  res.blockWidth = head.blockWidth;
+  res.blockHeight = head.blockHeight;
+  res.colorSpace = (ColorSpaces)head.colorSpace;
+  res.quantizer = Quantizers::LBG;
+
+  for (size_t i = 0; i < sections(); i++) {
+    const SectionHeader &section = sectionHeaders[i];
+    std::vector<char> codebookStorage;
+    std::vector<size_t> indexStorage;
+    CodebookSource src = source(i, codebookStorage, indexStorage);
+
+    // Truncated progressive section gives codebook of ancestors
+    const size_t codeVectorCount =
+        std::min<size_t>(section.codeVectors, (size_t)1 << planes(i));
+    res.progressive =
+        (IndexCoding)section.indexCoding == IndexCoding::PROGRESSIVE;
+    auto &codeVectors = i ? res.chromaCodeVectors : res.codeVectors;
+    auto &assigned = i ? res.chromaAssignedCodeVector : res.assignedCodeVector;
+    const size_t dim = section.codeVectorSize;
+    for (size_t k = 0; k < codeVectorCount; k++)
+      codeVectors.emplace_back(src.codeVectors + k * dim,
+                               src.codeVectors + (k + 1) * dim);
+    if (src.indices)
+      assigned = std::move(indexStorage);
+    else
+      assigned = unpackBits(src.packedIndices,
+                            section.gridWidth * section.gridHeight,
+                            src.bitsPerIndex);
+  }
+  return res;
+}
+
+MappedQuantFile::MappedQuantFile(const std::string &path)
+    : file(path), quantView(file.data(), file.size()) {}
@@ -1,152 +1,502 @@
 #include "Quantizer.hpp"
 #include "KDTree.hpp"
+#include "PCASearch.hpp"
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <iostream>
+#include <numeric>
+#include <random>
 
-class Solution
-{
+// Over-relaxation factor starts here, grows by step after every successful
+// extrapolation and is halved towards 1 after failed one.
+const VectorType INITIAL_RELAXATION = 1.5;
+const VectorType RELAXATION_STEP = 0.1;
+const VectorType MAX_RELAXATION = 1.9;
+
+static uint8_t toByte(VectorType x) {
+  return (uint8_t)std::min(std::max(std::round(x), (VectorType)0),
+                           (VectorType)UINT8_MAX);
+}
+
+std::vector<CharVector> toCharVectors(const std::vector<Vector> &vectors) {
+  std::vector<CharVector> res;
+  for (const auto &vector : vectors) {
+    res.emplace_back(vector.size());
+    std::transform(std::begin(vector), std::end(vector),
+                   std::begin(res.back()), toByte);
+  }
+  return res;
+}
+
+static ByteBlocks toByteBlocks(const std::vector<Vector> &vectors, size_t dim) {
+  ByteBlocks res(vectors.size(), dim);
+  for (size_t i = 0; i < vectors.size(); i++)
+    std::transform(std::begin(vectors[i]), std::end(vectors[i]), res[i],
+                   toByte);
+  return res;
+}
+
+// Adds ((x - center) . axis) (x - center) to `res` and returns the
+// projection, one power iteration step for principal axis of a cell.
+template <typename T>
+static VectorType accumulateSpread(const T *x, const Vector &center,
+                                   const Vector &axis, VectorType *res) {
+  const size_t dim = center.size();
+  VectorType projection = 0;
+  for (size_t j = 0; j < dim; j++)
+    projection += (x[j] - center[j]) * axis[j];
+  for (size_t j = 0; j < dim; j++)
+    res[j] += projection * (x[j] - center[j]);
+  return projection;
+}
+
+// Training sets used by Solution. Both of them know how to find nearest
+// codevector for i-th training vector and how to add that vector to
+// a running sum, rest of LBG algorithm doesn't care about representation.
+// Hint passed to nearest is codevector assigned in previous pass.
+
+class VectorTrainingSet {
+public:
+  typedef VectorType SumType;
+  // Number of vectors which can be summed in SumType without overflow
+  const static size_t MAX_ACCUMULATED = SIZE_MAX;
+
+  VectorTrainingSet(const std::vector<Vector> &vectors,
+                    const QuantizerParameters &parameters)
+      : dim(vectors.at(0).size()), vectors(vectors),
+        search(parameters.search) {}
+
+  size_t size() const { return vectors.size(); }
+
+  void setCodeVectors(const std::vector<Vector> &codeVectors) {
+    current = &codeVectors;
+    if (search == SearchMethods::PCA)
+      pca.reset(new PCASearch(dim, codeVectors));
+    else
+      kdtree.reset(new KDTree(dim, codeVectors));
+  }
+
+  size_t nearest(size_t i, size_t hint, VectorType &distance) const {
+    size_t found = search == SearchMethods::PCA
+                       ? pca->nearestNeighbour(vectors[i], hint, distance)
+                       : kdtree->nearestNeighbour(vectors[i]);
+    distance = squaredDistance(vectors[i], (*current)[found]);
+    return found;
+  }
+
+  void accumulate(size_t i, SumType *sum) const {
+    const Vector &x = vectors[i];
+    for (size_t j = 0; j < dim; j++)
+      sum[j] += x[j];
+  }
+
+  VectorType accumulateSpread(size_t i, const Vector &center,
+                              const Vector &axis, VectorType *res) const {
+    return ::accumulateSpread(&vectors[i][0], center, axis, res);
+  }
+
+  const size_t dim;
+
+private:
+  const std::vector<Vector> &vectors;
+  const std::vector<Vector> *current = nullptr;
+  const SearchMethods search;
+  std::unique_ptr<KDTree> kdtree;
+  std::unique_ptr<PCASearch> pca;
+};
+
+// Integer domain training set: blocks stay as raw bytes, codevectors are
+// rounded to bytes for search and sums are kept in 32-bit integers.
+class ByteTrainingSet {
 public:
-  VectorType updateDistortion() {
-    VectorType res = 0;
-    #pragma omp parallel for reduction(+:res)
-    for (size_t i = 0; i < trainingSet.size(); i++) {
-      const auto &x = trainingSet[i];
-      const auto &c = codeVectors[assignedCodeVector[i]];
-      res += norm(x - c);
+  typedef uint32_t SumType;
+  const static size_t MAX_ACCUMULATED = UINT32_MAX / UINT8_MAX;
+
+  ByteTrainingSet(const ByteBlocks &blocks,
+                  const QuantizerParameters &parameters)
+      : dim(blocks.dim), blocks(blocks), search(parameters.search) {}
+
+  size_t size() const { return blocks.size(); }
+
+  void setCodeVectors(const std::vector<Vector> &codeVectors) {
+    codeBook = toByteBlocks(codeVectors, dim);
+    if (search == SearchMethods::PCA) {
+      // Search on rounded codevectors, so distances stay exact
+      std::vector<Vector> rounded(codeBook.size(), Vector(dim));
+      for (size_t c = 0; c < codeBook.size(); c++)
+        std::copy(codeBook[c], codeBook[c] + dim, std::begin(rounded[c]));
+      pca.reset(new PCASearch(dim, rounded));
     }
+  }
+
+  size_t nearest(size_t i, size_t hint, VectorType &distance) const {
+    uint32_t best;
+    size_t found;
+    if (search == SearchMethods::PCA) {
+      Vector x(blocks[i], blocks[i] + dim);
+      found = pca->nearestNeighbour(x, hint, distance);
+      best = squaredDistance(blocks[i], codeBook[found], blocks.stride);
+    } else
+      found = nearestBlock(blocks[i], codeBook, best);
+    distance = best;
+    return found;
+  }
 
-    res /= ((VectorType)(trainingSet.size() * dim));
+  void accumulate(size_t i, SumType *sum) const {
+    const uint8_t *x = blocks[i];
+    for (size_t j = 0; j < dim; j++)
+      sum[j] += x[j];
+  }
 
-    distortion = res;
-    return res;
+  VectorType accumulateSpread(size_t i, const Vector &center,
+                              const Vector &axis, VectorType *res) const {
+    return ::accumulateSpread(blocks[i], center, axis, res);
   }
 
+  const size_t dim;
+
+private:
+  const ByteBlocks &blocks;
+  const SearchMethods search;
+  ByteBlocks codeBook;
+  std::unique_ptr<PCASearch> pca;
+};
+
+template <typename TrainingSet>
+class Solution
+{
+public:
+  // Single parallel sweep over training set, every vector is assigned to
+  // its nearest codevector and per-cell sums, sizes and distortion are
+  // gathered on the way, so fixCodeVectors doesn't touch training set.
+  // With principal splitting the same sweep refines axis of every cell.
   void assignCodeVectors() {
-    const KDTree kdtree(dim, codeVectors);
-  
-    #pragma omp parallel for
-    for (size_t i = 0; i < trainingSet.size(); i++) {
-      size_t found = kdtree.nearestNeighbour(trainingSet[i]);
-      assignedCodeVector[i] = found;
+    typedef typename TrainingSet::SumType SumType;
+    const size_t cells = codeVectors.size();
+    const bool principal = split == SplitMethods::PRINCIPAL;
+    trainingSet.setCodeVectors(codeVectors);
+
+    cellSum.assign(cells * dim, 0);
+    cellSize.assign(cells, 0);
+    cellDistortion.assign(cells, 0);
+    std::vector<VectorType> cellSpread(principal ? cells * dim : 0);
+    cellVariance.assign(cells, 0);
+
+    #pragma omp parallel
+    {
+      std::vector<SumType> partialSum(cells * dim);
+      std::vector<VectorType> sum(cells * dim);
+      std::vector<size_t> size(cells);
+      std::vector<VectorType> distortion(cells);
+      std::vector<VectorType> spread(cellSpread.size());
+      std::vector<VectorType> variance(principal ? cells : 0);
+      size_t pending = 0;
+
+      auto flush = [&]() {
+        for (size_t j = 0; j < sum.size(); j++) {
+          sum[j] += partialSum[j];
+          partialSum[j] = 0;
+        }
+        pending = 0;
+      };
+
+      #pragma omp for nowait
+      for (size_t i = 0; i < trainingSet.size(); i++) {
+        VectorType d;
+        size_t c = trainingSet.nearest(i, assignedCodeVector[i], d);
+        assignedCodeVector[i] = c;
+        trainingSet.accumulate(i, &partialSum[c * dim]);
+        size[c]++;
+        distortion[c] += d;
+        if (principal) {
+          VectorType projection = trainingSet.accumulateSpread(
+              i, codeVectors[c], axes[c], &spread[c * dim]);
+          variance[c] += projection * projection;
+        }
+        if (++pending == TrainingSet::MAX_ACCUMULATED)
+          flush();
+      }
+      flush();
+
+      #pragma omp critical
+      {
+        for (size_t j = 0; j < sum.size(); j++)
+          cellSum[j] += sum[j];
+        for (size_t c = 0; c < cells; c++) {
+          cellSize[c] += size[c];
+          cellDistortion[c] += distortion[c];
+        }
+        for (size_t j = 0; j < spread.size(); j++)
+          cellSpread[j] += spread[j];
+        for (size_t c = 0; c < variance.size(); c++)
+          cellVariance[c] += variance[c];
+      }
     }
+
+    if (principal)
+      for (size_t c = 0; c < cells; c++) {
+        Vector axis(&cellSpread[c * dim], &cellSpread[c * dim] + dim);
+        VectorType length = std::sqrt(norm(axis));
+        if (length > 0)
+          axes[c] = axis / length;
+        if (cellSize[c])
+          cellVariance[c] /= (VectorType)cellSize[c];
+      }
+
+    distortion = std::accumulate(std::begin(cellDistortion),
+                                 std::end(cellDistortion), (VectorType)0);
+    distortion /= (VectorType)(trainingSet.size() * dim);
   }
 
-  VectorType getDistortionInArea(const std::vector<size_t> &area,
-                                 const Vector &codeVector) {
-    VectorType res = 0;
-    #pragma omp parallel for reduction(+:res)
-    for (size_t i = 0; i < area.size(); i++) {
-      const auto &x = trainingSet[area[i]];
-      auto tmp = norm(x - codeVector);
-      res += tmp;
-    }
-    return res / ((VectorType)(trainingSet.size() * dim));
-  }
-
-  Vector trainingSetSum() {
-    Vector sum(dim);
-    Vector c(dim);
-  
-    for (size_t i = 0; i < trainingSet.size(); i++) {
-      Vector y = trainingSet[i] - c;
-      Vector t = sum + y;
-      c = (t - sum) - y;
-      sum = t;
+  // Half of distance between children when cell c is split in two. Along
+  // principal axis when it is tracked, random direction otherwise, both
+  // scaled so children land near conditional means of a gaussian cell.
+  Vector splitOffset(size_t c) {
+    if (split == SplitMethods::PRINCIPAL)
+      return axes[c] * (VectorType)(0.8 * std::sqrt(cellVariance[c]));
+
+    Vector direction(dim);
+    for (auto &x : direction)
+      x = (VectorType)generator() / generator.max() - (VectorType)0.5;
+    VectorType length = std::sqrt(norm(direction));
+    VectorType deviation =
+        std::sqrt(cellDistortion[c] / (VectorType)(cellSize[c] * dim));
+    return direction * (VectorType)(0.8 * deviation / length);
+  }
+
+  // Every codevector becomes centroid of its cell. Empty cells are reseeded
+  // by splitting cells with the biggest distortion, using statistics of
+  // the last pass only.
+  void fixCodeVectors() {
+    std::vector<size_t> empty;
+    for (size_t c = 0; c < codeVectors.size(); c++) {
+      if (cellSize[c] == 0) {
+        empty.push_back(c);
+        continue;
+      }
+      for (size_t j = 0; j < dim; j++)
+        codeVectors[c][j] = cellSum[c * dim + j] / (VectorType)cellSize[c];
     }
-    return sum;
-  }
-
-  Vector sumInArea(const std::vector<size_t> &area) {
-    Vector sum(dim);
-    Vector c(dim);
-  
-    for (auto x : area) {
-      Vector y = trainingSet[x] - c;
-      Vector t = sum + y;
-      c = (t - sum) - y;
-      sum = t;
+
+    reseeded.assign(codeVectors.size(), false);
+    if (empty.empty())
+      return;
+
+    std::vector<size_t> worst;
+    for (size_t c = 0; c < codeVectors.size(); c++)
+      if (cellSize[c] > 1)
+        worst.push_back(c);
+    size_t count = std::min(empty.size(), worst.size());
+    std::partial_sort(std::begin(worst), std::begin(worst) + count,
+                      std::end(worst), [&](size_t a, size_t b) {
+                        return cellDistortion[a] > cellDistortion[b];
+                      });
+
+    for (size_t k = 0; k < count; k++) {
+      size_t from = worst[k], to = empty[k];
+      Vector offset = splitOffset(from);
+      codeVectors[to] = codeVectors[from] - offset;
+      codeVectors[from] += offset;
+      if (split == SplitMethods::PRINCIPAL)
+        axes[to] = axes[from];
+      reseeded[from] = reseeded[to] = true;
     }
-    return sum;
   }
 
-  void fixCodeVectors() {
-    std::vector<std::vector<size_t>> codeVectorArea(codeVectors.size());
-  
-    for (size_t i = 0; i < trainingSet.size(); i++) {
-      int cur = assignedCodeVector[i];
-      codeVectorArea[cur].push_back(i);
+  // Splits `count` cells with the biggest distortion. Second child is
+  // appended at the end, so with all cells split children of i-th cell
+  // are i and i + size.
+  void splitCodeVectors(size_t count) {
+    std::vector<size_t> chosen(codeVectors.size());
+    std::iota(std::begin(chosen), std::end(chosen), 0);
+    if (count < chosen.size()) {
+      std::nth_element(std::begin(chosen), std::begin(chosen) + count,
+                       std::end(chosen), [&](size_t a, size_t b) {
+                         return cellDistortion[a] > cellDistortion[b];
+                       });
+      chosen.resize(count);
+      std::sort(std::begin(chosen), std::end(chosen));
     }
 
-    #pragma omp parallel for
-    for (size_t i = 0; i < codeVectors.size(); i++) {
-      codeVectors[i] = sumInArea(codeVectorArea[i]);
-  
-      if (codeVectorArea[i].size())
-        codeVectors[i] /= (VectorType)codeVectorArea[i].size();
+    for (auto c : chosen) {
+      Vector child = codeVectors[c];
+      if (split == SplitMethods::PRINCIPAL) {
+        Vector offset = splitOffset(c);
+        codeVectors[c] += offset;
+        child -= offset;
+        axes.push_back(axes[c]);
+      } else {
+        codeVectors[c] *= (VectorType)(1 + 0.2);
+        child *= (VectorType)(1 - 0.2);
+      }
+      codeVectors.emplace_back(std::move(child));
     }
   }
 
-  Solution(const std::vector<Vector> &trainingSet, size_t codeVectorsSize, VectorType eps) :
-    trainingSet(trainingSet),
-    dim(trainingSet.at(0).size()),
-    eps(eps)
-  {
-    codeVectors.resize(codeVectorsSize);
+  // Single codevector being average of training set
+  void initialize() {
+    codeVectors.assign(1, Vector(dim));
+    axes.assign(1, Vector(dim, 1 / std::sqrt((VectorType)dim)));
+    assignCodeVectors();
+    fixCodeVectors();
+    // Spread has to be measured around the mean before first split
+    if (split == SplitMethods::PRINCIPAL)
+      assignCodeVectors();
+  }
+
+  template <typename TrainingData>
+  Solution(const TrainingData &trainingData,
+           const QuantizerParameters &parameters, VectorType eps)
+      : trainingSet(trainingData, parameters), dim(trainingSet.dim), eps(eps),
+        split(parameters.split), acceleration(parameters.acceleration),
+        generator(parameters.seed) {
     assignedCodeVector.resize(trainingSet.size());
   }
 
+  // Moves every codevector `relaxation` times as far as plain Lloyd step
+  // did, starting from `previous`. Reseeded cells are left alone.
+  void overRelax(const std::vector<Vector> &previous, VectorType relaxation) {
+    for (size_t c = 0; c < codeVectors.size(); c++)
+      if (!reseeded[c])
+        codeVectors[c] =
+            previous[c] + (codeVectors[c] - previous[c]) * relaxation;
+  }
+
   void LBGIterate(const size_t MAX_IT = 100) {
+    const bool accelerate = acceleration == Accelerations::OVER_RELAXATION;
+    VectorType relaxation = INITIAL_RELAXATION;
+    std::vector<Vector> previous, plain;
+
     assignCodeVectors();
-    updateDistortion();
     for (size_t it = 0; it < MAX_IT; it++) {
+      if (accelerate)
+        previous = codeVectors;
       fixCodeVectors();
       VectorType oldDistortion = distortion;
-      updateDistortion();
-      if (std::abs(oldDistortion - distortion) / oldDistortion <= eps)
+
+      if (accelerate) {
+        plain = codeVectors;
+        overRelax(previous, relaxation);
+      }
+      assignCodeVectors();
+
+      if (accelerate) {
+        if (distortion > oldDistortion) {
+          // Extrapolation overshot, fall back to plain Lloyd step
+          codeVectors = std::move(plain);
+          assignCodeVectors();
+          relaxation = 1 + (relaxation - 1) / 2;
+        } else
+          relaxation = std::min(relaxation + RELAXATION_STEP, MAX_RELAXATION);
+      }
+
+      if (oldDistortion == 0 ||
+          std::abs(oldDistortion - distortion) / oldDistortion <= eps)
         break;
     }
   }
 
 public:
-  const std::vector<Vector> &trainingSet;
+  TrainingSet trainingSet;
   std::vector<size_t> assignedCodeVector;
   std::vector<Vector> codeVectors;
+  std::vector<VectorType> cellSum;
+  std::vector<size_t> cellSize;
+  std::vector<VectorType> cellDistortion;
+  // Principal axis estimate and variance along it for every cell
+  std::vector<Vector> axes;
+  std::vector<VectorType> cellVariance;
   VectorType distortion;
-  const VectorType dim;
+  const size_t dim;
   const VectorType eps;
+  const SplitMethods split;
+  const Accelerations acceleration;
+  // Cells moved by reseeding in last fixCodeVectors
+  std::vector<bool> reseeded;
+  std::mt19937 generator;
 };
 
 class LBGQuantizer : public AbstractQuantizer {
 public:
+  LBGQuantizer(const QuantizerParameters &parameters)
+      : parameters(parameters) {}
+
   virtual std::tuple<std::vector<Vector>, std::vector<size_t>, VectorType>
-  quantize(const std::vector<Vector> &trainingSet, size_t bitsPerCodeVector, VectorType eps) {
+  quantize(const std::vector<Vector> &trainingSet, size_t bitsPerCodeVector,
+           VectorType eps) {
+    Solution<VectorTrainingSet> solution(trainingSet, parameters, eps);
+    run(solution, bitsPerCodeVector);
+    return std::make_tuple(solution.codeVectors, solution.assignedCodeVector,
+                           solution.distortion);
+  }
 
-    Solution solution(trainingSet, 1, eps);
-    size_t maxCodeVectors = 1 << bitsPerCodeVector;
+  virtual std::tuple<std::vector<CharVector>, std::vector<size_t>, VectorType>
+  quantize(const ByteBlocks &trainingSet, size_t bitsPerCodeVector,
+           VectorType eps) {
+    Solution<ByteTrainingSet> solution(trainingSet, parameters, eps);
+    run(solution, bitsPerCodeVector);
+
+    // Assignment was done against codevectors rounded in the same way
+    return std::make_tuple(toCharVectors(solution.codeVectors),
+                           solution.assignedCodeVector, solution.distortion);
+  }
+
+private:
+  const QuantizerParameters parameters;
+
+  template <typename TrainingSet>
+  void run(Solution<TrainingSet> &solution, size_t bitsPerCodeVector) {
+    size_t maxCodeVectors = parameters.codeVectors ? parameters.codeVectors
+                                                   : 1 << bitsPerCodeVector;
 
     auto &codeVectors = solution.codeVectors;
-    // Initialize values
-    codeVectors[0] = solution.trainingSetSum();
-    codeVectors[0] /= (VectorType)(trainingSet.size());
-
-    while (solution.codeVectors.size() < maxCodeVectors) {
-      // splitting phase
-      concat(codeVectors, codeVectors);
-      for (size_t i = 0; i < codeVectors.size() / 2; i++) {
-        codeVectors[i] *= (VectorType)(1 + 0.2);
-        codeVectors[i + codeVectors.size() / 2] *= (VectorType)(1 - 0.2);
-      }
+    solution.initialize();
+    if (maxCodeVectors == 1)
+      solution.assignCodeVectors();
 
+    auto proceed = [&]() {
+      return !parameters.onSplit ||
+             parameters.onSplit(codeVectors, solution.assignedCodeVector,
+                                solution.distortion);
+    };
+    if (!proceed())
+      return;
+    while (codeVectors.size() < maxCodeVectors) {
+      // splitting phase, last one may split only part of the cells
+      solution.splitCodeVectors(
+          std::min(codeVectors.size(), maxCodeVectors - codeVectors.size()));
       solution.LBGIterate();
+      if (!proceed())
+        return;
     }
-    return std::make_tuple(codeVectors, solution.assignedCodeVector, solution.distortion);
   }
 };
 
-QuantizerPtr getQuantizer(Quantizers q) {
+std::tuple<std::vector<CharVector>, std::vector<size_t>, VectorType>
+AbstractQuantizer::quantize(const ByteBlocks &trainingSet, size_t n,
+                            VectorType eps) {
+  std::vector<Vector> vectors(trainingSet.size(), Vector(trainingSet.dim));
+  for (size_t i = 0; i < vectors.size(); i++)
+    std::copy(trainingSet[i], trainingSet[i] + trainingSet.dim,
+              std::begin(vectors[i]));
+
+  std::vector<Vector> codeVectors;
+  std::vector<size_t> assignedCodeVector;
+  VectorType distortion;
+  std::tie(codeVectors, assignedCodeVector, distortion) =
+      quantize(vectors, n, eps);
+
+  return std::make_tuple(toCharVectors(codeVectors), assignedCodeVector,
+                         distortion);
+}
+
+QuantizerPtr getQuantizer(Quantizers q,
+                          const QuantizerParameters &parameters) {
   switch (q) {
   case Quantizers::LBG:
-    return QuantizerPtr(new LBGQuantizer());
+    return QuantizerPtr(new LBGQuantizer(parameters));
     break;
   default:
     return nullptr;
@@ -1,35 +1,16 @@
 #include "RGBImage.hpp"
-#include <cassert>
-#include <fstream>
-#include <iostream>
+#include "ImageIO.hpp"
 
 RGBImage::RGBImage(const std::string &path) {
-  std::fstream fs;
-  fs.open(path, std::fstream::in | std::fstream::binary);
-  std::string magic;
-  fs >> magic;
-  assert(magic == "P6");
-
-  int x, y, max_col;
-
-  fs >> x >> y >> max_col;
-  fs.get();
-  xSize = x;
-  ySize = y;
-  img.resize(x * y);
-  assert(max_col == MAX_COL - 1);
-
-  fs.read((char *)img.data(), img.size() * 3);
-  fs.close();
+  ImageFile file(path);
+  const RGBView &view = file.view();
+  xSize = view.xSize;
+  ySize = view.ySize;
+  img.resize(view.xSize * view.ySize);
+  for (size_t y = 0; y < view.ySize; y++)
+    std::copy(view.row(y), view.row(y) + view.xSize, &img[y * view.xSize]);
 }
 
-void RGBImage::saveToFile(const std::string &path) {
-  std::fstream fs;
-  fs.open(path, std::fstream::out | std::fstream::trunc);
-  fs << "P6\n" << xSize << " " << ySize << "\n" << MAX_COL - 1 << "\n";
-  fs.write((char *)img.data(), img.size() * 3);
-  fs.flush();
-  fs.close();
-}
+void RGBImage::saveToFile(const std::string &path) { saveImage(*this, path); }
 
 size_t RGBImage::sizeInBytes() const { return img.size() * 3; }
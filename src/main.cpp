@@ -1,15 +1,24 @@
+#include "Batch.hpp"
 #include "Compressor.hpp"
 #include "Debug.hpp"
+#include "ImageIO.hpp"
 #include "ProgramParameters.hpp"
+#include "QuantFormat.hpp"
 #include "RGBImage.hpp"
 #include "nanoflann.hpp"
 
 #include "boost/program_options.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 
 enum class FileType
 {
-  NOT_SUPPORTED, PPM, QUANT, LAST
+  NOT_SUPPORTED, IMAGE, QUANT, LAST
 };
 
 int fileTypeMap(FileType a, FileType b)
@@ -33,12 +42,103 @@ FileType getFileType(std::string path)
   }
   if(fileExt == ".quant")
     return FileType::QUANT;
-  if(fileExt == ".ppm")
-    return FileType::PPM;
+  // Netpbm, PNG and QOI are all uncompressed images to quant
+  for (const auto &ext : imageExtensions())
+    if(fileExt == ext)
+      return FileType::IMAGE;
 
   return FileType::NOT_SUPPORTED;
 }
 
+// Parses list like "4-8,10" into levels 4, 5, 6, 7, 8, 10, empty on error
+std::vector<int> parseLevels(const std::string &list)
+{
+  std::vector<int> res;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+  {
+    int first, last;
+    char end;
+    int parsed = std::sscanf(item.c_str(), "%d-%d%c", &first, &last, &end);
+    if (parsed == 1)
+      last = first;
+    else if (parsed != 2)
+      return {};
+    if (first < 0 || last < first || last > 24)
+      return {};
+    for (int level = first; level <= last; level++)
+      res.push_back(level);
+  }
+  return res;
+}
+
+// Path of rate sweep output, "out.quant" at level 4 is "out-n4.quant"
+std::string levelPath(const std::string &path, size_t level)
+{
+  size_t dot = path.rfind('.');
+  size_t slash = path.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    dot = path.size();
+  return path.substr(0, dot) + "-n" + std::to_string(level) + path.substr(dot);
+}
+
+// One report line per image, shared by rate sweeps and batches
+void printRaportLine(const CompressionRaport &raport, const std::string &path,
+                     std::ostream &out = std::cout)
+{
+  out << "bpp=" << raport.bitsPerPixel << " psnr=" << raport.psnr
+            << " ssim=" << raport.ssim << " ms-ssim=" << raport.msSsim
+            << " time=" << raport.compressionTime.count() << "s " << path << std::endl;
+}
+
+int runBatch(const ProgramParameters &par)
+{
+  const auto formats = imageExtensions();
+  if (par.batchFormat != "quant" &&
+      std::find(formats.begin(), formats.end(), "." + par.batchFormat) == formats.end())
+  {
+    std::cerr << "Batch format has to be quant or an image extension, e.g. ppm or png" << std::endl;
+    return 1;
+  }
+
+  BatchSettings settings;
+  settings.quantizer = (Quantizers)par.quantizer;
+  settings.colorSpace = (ColorSpaces)par.colorspace;
+  settings.blockWidth = par.width;
+  settings.blockHeight = par.height;
+  settings.eps = par.eps;
+  settings.n = par.n;
+  settings.parameters.search = (SearchMethods)par.search;
+  settings.parameters.split = (SplitMethods)par.split;
+  settings.parameters.acceleration = (Accelerations)par.acceleration;
+  settings.parameters.seed = par.seed;
+  settings.parameters.codeVectors = par.codevectors;
+  settings.parameters.progressive = par.progressive;
+  settings.threads = par.threads;
+
+  std::vector<BatchJob> jobs;
+  for (const auto &input : listImages(par.batch, imageExtensions()))
+  {
+    std::string name = input.substr(input.rfind('/') + 1);
+    name = name.substr(0, name.rfind('.'));
+    jobs.push_back({input, par.saveto + "/" + name + "." + par.batchFormat});
+  }
+
+  int failed = 0;
+  compressBatch(jobs, settings, [&](const BatchResult &result)
+  {
+    if (!result.error.empty())
+    {
+      std::cerr << result.job.input << ": " << result.error << std::endl;
+      failed++;
+    }
+    else
+      printRaportLine(result.raport, result.job.output);
+  });
+  return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv) 
 {
   namespace po = boost::program_options;
@@ -47,14 +147,29 @@ int main(int argc, char **argv)
   desc.add_options()
     ("help", "Print help messages")
     (",n", po::value<int>(&par->n)->default_value(8), "bits per codevector")
+    (",k", po::value<int>(&par->codevectors)->default_value(0), "Number of codevectors, overrides n when not 0")
     (",e", po::value<float>(&par->eps)->default_value(0.000001), "eps parameter for quantization algorithm")
     (",w", po::value<int>(&par->width)->default_value(2), "Width of block")
     (",h", po::value<int>(&par->height)->default_value(2), "Height of block") 
-    ("file", po::value<std::string>(&par->file)->required(), "File to compress/decompress")
-    ("saveto,o", po::value<std::string>(&par->saveto)->required(), "Save to")
+    ("file", po::value<std::string>(&par->file), "File to compress/decompress, - is stdin")
+    ("saveto,o", po::value<std::string>(&par->saveto)->required(), "Save to, - is stdout")
+    ("from", po::value<std::string>(&par->from), "Format of input instead of its extension, e.g. png or quant")
+    ("to", po::value<std::string>(&par->to), "Format of output instead of its extension, e.g. ppm or quant")
     (",r", po::value<bool>(&par->raport)->default_value(false), "Print raport to std::out")
     ("quantizer,q", po::value<int>(&par->quantizer)->default_value((int)Quantizers::LBG), "Pick quantizer")
-    ("c,colorspace", po::value<int>(&par->colorspace)->default_value((int)ColorSpaces::SCALED), "Pick ColorSpace");
+    ("c,colorspace", po::value<int>(&par->colorspace)->default_value((int)ColorSpaces::SCALED), "Pick ColorSpace: 0 - RGB, 1 - scaled RGB, 2 - CIE 1931, 3 - YCbCr, 4 - CIELAB, 5 - YCbCr 4:2:0")
+    ("search,s", po::value<int>(&par->search)->default_value((int)SearchMethods::DEFAULT), "Pick nearest codevector search, 1 is PCA projected")
+    ("split", po::value<int>(&par->split)->default_value((int)SplitMethods::SCALE), "Pick splitting method, 1 is along principal axis")
+    ("accelerate", po::value<int>(&par->acceleration)->default_value((int)Accelerations::NONE), "Pick LBG acceleration, 1 is over-relaxation")
+    ("seed", po::value<unsigned>(&par->seed)->default_value(0), "Seed used for reseeding empty regions")
+    ("region", po::value<std::string>(&par->region), "Decode only region x,y,w,h of .quant file")
+    ("progressive", po::value<bool>(&par->progressive)->default_value(false), "Save .quant file as progressive stream, its prefix decodes to a preview")
+    ("rates", po::value<std::string>(&par->rates), "Levels of n to save from one splitting run, e.g. 4-12 or 4,6,8; output name gets -n<level> suffix")
+    ("target-psnr", po::value<float>(&par->targetPsnr)->default_value(0), "Stop splitting at first level reaching this PSNR")
+    ("target-bpp", po::value<float>(&par->targetBitsPerPixel)->default_value(0), "Stop splitting before first level above this many bits per pixel")
+    ("batch", po::value<std::vector<std::string>>(&par->batch)->multitoken(), "Compress images and directories of them, -o is output directory")
+    ("batch-format", po::value<std::string>(&par->batchFormat)->default_value("quant"), "Format of batch outputs: quant, ppm, png, qoi, ...")
+    ("threads", po::value<unsigned>(&par->threads)->default_value(0), "Threads used by batch, 0 is all");
 
   po::variables_map vm;
 
@@ -70,44 +185,164 @@ int main(int argc, char **argv)
   }
   vm.notify();
 
-  FileType fromType = getFileType(par->file);
-  FileType toType = getFileType(par->saveto);
-
-  auto runCompression = [&]()
+  if (!par->batch.empty())
+    return runBatch(*par);
+  if (par->file.empty())
   {
-    RGBImage img(par->file);
-    auto result = CompressedImage::compress
-        (img, (Quantizers)par->quantizer, (ColorSpaces)par->colorspace, par->width, par->height, par->eps, par->n);
-    if (par->raport)
-      std::cout << result.second;
-    return result.first;
-  };
+    std::cerr << "No input file given" << std::endl;
+    return 1;
+  }
 
-  auto runDecompression = [&](auto &cImg)
+  std::vector<int> levels;
+  if (!par->rates.empty() && (levels = parseLevels(par->rates)).empty())
   {
-    RGBImage decompressed = CompressedImage::decompress(cImg);
-    decompressed.saveToFile(par->saveto);
-  };
+    std::cerr << "Levels have to be given as list of n or ranges, e.g. 4-8,10" << std::endl;
+    return 1;
+  }
 
-  if(fromType == FileType::PPM && toType == FileType::PPM)
+  // "-" is stdin or stdout, their format is given by --from and --to,
+  // which override extensions of files as well
+  const bool fromStdin = par->file == "-", toStdout = par->saveto == "-";
+  if ((fromStdin && par->from.empty()) || (toStdout && par->to.empty()))
   {
-    auto cImg = runCompression();
-    runDecompression(cImg);
+    std::cerr << "Standard input and output need --from and --to formats" << std::endl;
+    return 1;
   }
-  else if(fromType == FileType::QUANT && toType == FileType::PPM)
+  const std::string fromPath = par->from.empty() ? par->file : "." + par->from;
+  const std::string toPath = par->to.empty() ? par->saveto : "." + par->to;
+  FileType fromType = getFileType(fromPath);
+  FileType toType = getFileType(toPath);
+
+  const bool targeted = par->targetPsnr > 0 || par->targetBitsPerPixel > 0;
+  if (toStdout && !par->rates.empty() && !targeted)
   {
-    CompressedImage cImg;
-    cImg.loadFromFile(par->file);
-    runDecompression(cImg);
+    std::cerr << "Rate sweep writes several files, it can not write to stdout" << std::endl;
+    return 1;
   }
-  else if(fromType == FileType::PPM && toType == FileType::QUANT)
+  // Reports must not mix with image written to stdout
+  std::ostream &log = toStdout ? std::cerr : std::cout;
+
+  // Output goes to file at `path` or to stdout, in format of toPath
+  auto output = [&](const std::string &path, const std::function<void(std::ostream &)> &write)
+  {
+    if (toStdout)
+    {
+      write(std::cout);
+      if (!std::cout.flush())
+        throw std::runtime_error("Cannot write standard output");
+      return;
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+      throw std::runtime_error("Cannot open " + path);
+    write(file);
+    if (!file.flush())
+      throw std::runtime_error("Cannot write " + path);
+  };
+  auto outputImage = [&](const RGBView &image, const std::string &path)
+  {
+    output(path, [&](std::ostream &out) { writeImage(image, out, toPath); });
+  };
+
+  // Compressed images with paths they are saved to, rate sweep gives one
+  // image per level
+  auto runCompression = [&]()
   {
-    auto cImg = runCompression();
-    cImg.saveToFile(par->saveto);
+    // Raw 8 bit RGB Netpbm files are compressed straight from the mapping,
+    // stdin is decoded as it arrives
+    std::unique_ptr<ImageFile> file;
+    RGBImage streamed;
+    if (fromStdin)
+      streamed = readImage(std::cin, fromPath);
+    else
+      file.reset(new ImageFile(par->file, imageFormat(fromPath)));
+    const RGBView img = fromStdin ? RGBView(streamed) : file->view();
+    CompressionParameters parameters;
+    parameters.search = (SearchMethods)par->search;
+    parameters.split = (SplitMethods)par->split;
+    parameters.acceleration = (Accelerations)par->acceleration;
+    parameters.seed = par->seed;
+    parameters.codeVectors = par->codevectors;
+    parameters.progressive = par->progressive;
+    parameters.targetPsnr = par->targetPsnr;
+    parameters.targetBitsPerPixel = par->targetBitsPerPixel;
+
+    std::vector<std::pair<CompressedImage, std::string>> res;
+    if (par->rates.empty() && !targeted)
+    {
+      auto result = CompressedImage::compress
+          (img, (Quantizers)par->quantizer, (ColorSpaces)par->colorspace, par->width, par->height, par->eps, par->n, parameters);
+      if (par->raport)
+        log << result.second;
+      res.emplace_back(std::move(result.first), par->saveto);
+      return res;
+    }
+
+    // Target picks one of levels up to n, unless levels are given
+    if (levels.empty())
+      for (int level = 0; level <= par->n; level++)
+        levels.push_back(level);
+
+    auto points = CompressedImage::compressRatePoints
+        (img, (Quantizers)par->quantizer, (ColorSpaces)par->colorspace, par->width, par->height, par->eps, levels, parameters);
+    for (auto &point : points)
+    {
+      const size_t level = bitsPerIndex(point.first.codeVectors.size());
+      std::string path = targeted ? par->saveto : levelPath(par->saveto, level);
+      log << "n=" << level << " ";
+      printRaportLine(point.second, path, log);
+      res.emplace_back(std::move(point.first), path);
+    }
+    return res;
+  };
+
+  // Malformed input files and failed writes throw
+  try
+  {
+    if(fromType == FileType::IMAGE && toType == FileType::IMAGE)
+    {
+      for (auto &compressed : runCompression())
+        outputImage(CompressedImage::decompress(compressed.first), compressed.second);
+    }
+    else if(fromType == FileType::QUANT && toType == FileType::IMAGE)
+    {
+      // Decoded straight from mapped file or stdin data, codebooks are
+      // not copied
+      std::unique_ptr<MappedQuantFile> file;
+      std::vector<uint8_t> data;
+      if (fromStdin)
+        data = readStream(std::cin);
+      else
+        file.reset(new MappedQuantFile(par->file));
+      const QuantView view = fromStdin ? QuantView(data.data(), data.size()) : file->view();
+      if (par->region.empty())
+        outputImage(view.decompress(), par->saveto);
+      else
+      {
+        size_t x, y, w, h;
+        char end;
+        if (std::sscanf(par->region.c_str(), "%zu,%zu,%zu,%zu%c", &x, &y, &w, &h, &end) != 4)
+        {
+          std::cerr << "Region has to be given as x,y,w,h" << std::endl;
+          return 1;
+        }
+        outputImage(view.decompressRegion(x, y, w, h), par->saveto);
+      }
+    }
+    else if(fromType == FileType::IMAGE && toType == FileType::QUANT)
+    {
+      for (auto &compressed : runCompression())
+        output(compressed.second, [&](std::ostream &out) { compressed.first.save(out); });
+    }
+    else
+    {
+      std::cerr << "File type not supported" << std::endl;
+      return 1;
+    }
   }
-  else
+  catch (const std::exception &e)
   {
-    std::cerr << "File type not supported" << std::endl;
+    std::cerr << e.what() << std::endl;
     return 1;
   }
 }
@@ -1,7 +1,29 @@
+#include "Batch.hpp"
+#include "BitPacking.hpp"
 #include "Compressor.hpp"
+#include "ContextCoding.hpp"
 #include "Debug.hpp"
+#include "EntropyCoding.hpp"
+#include "ImageIO.hpp"
+#include "Metrics.hpp"
+#include "Netpbm.hpp"
+#include "PCASearch.hpp"
+#include "Png.hpp"
+#include "QuantC.h"
+#include "QuantFormat.hpp"
+#include "Qoi.hpp"
+#include "Quantizer.hpp"
 #include "gtest/gtest.h"
 
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+
 TEST(compressor_test, something) {
   RGBImage testImg;
   testImg.img = {
@@ -60,3 +82,1126 @@ TEST(compressor_test, something) {
     EXPECT_EQ(expected.img, testImg.img);
   }
 }
+
+TEST(compressor_test, non_square_blocks) {
+  RGBImage testImg;
+  testImg.xSize = 5;
+  testImg.ySize = 3;
+  for (int i = 0; i < testImg.xSize * testImg.ySize; i++)
+    testImg.img.push_back({(char)(i * 3), (char)(i * 5), (char)(200 + i)});
+  ColorSpacePtr cs = getColorSpace(ColorSpaces::NORMAL);
+
+  for (int w = 1; w <= 3; w++)
+    for (int h = 1; h <= 4; h++) {
+      auto blocks = getBlocksAsVectorsFromImage(testImg, w, h, cs);
+      auto bytes = getBlocksAsBytesFromImage(testImg, w, h);
+      ASSERT_EQ(blocks.size(), bytes.size());
+      for (size_t i = 0; i < blocks.size(); i++)
+        for (size_t j = 0; j < bytes.dim; j++)
+          EXPECT_EQ(blocks[i][j], bytes[i][j]);
+
+      auto converted = vectorsToCharVectorsColorSpaced(blocks, cs);
+      auto expected =
+          getImageFromVectors(converted, testImg.xSize, testImg.ySize, w, h);
+      EXPECT_EQ(expected.img, testImg.img);
+    }
+
+  // Decoding from codebook matches decoding of gathered blocks
+  for (int w = 1; w <= 5; w++)
+    for (int h = 1; h <= 4; h++) {
+      size_t count =
+          ((testImg.xSize + w - 1) / w) * ((testImg.ySize + h - 1) / h);
+      std::vector<CharVector> codeVectors(3, CharVector(w * h * 3));
+      for (size_t c = 0; c < codeVectors.size(); c++)
+        for (size_t j = 0; j < codeVectors[c].size(); j++)
+          codeVectors[c][j] = (char)(c * 50 + j);
+      std::vector<size_t> assigned(count);
+      std::vector<CharVector> gathered(count);
+      for (size_t i = 0; i < count; i++) {
+        assigned[i] = (i * 7) % codeVectors.size();
+        gathered[i] = codeVectors[assigned[i]];
+      }
+      EXPECT_EQ(getImageFromCodeVectors(codeVectors, assigned, testImg.xSize,
+                                        testImg.ySize, w, h)
+                    .img,
+                getImageFromVectors(gathered, testImg.xSize, testImg.ySize, w,
+                                    h)
+                    .img);
+    }
+
+  // Blocks go row by row, pixels inside a block too
+  auto blocks = getBlocksAsBytesFromImage(testImg, 2, 2);
+  EXPECT_EQ(blocks.size(), 6u);
+  EXPECT_EQ(blocks[1][0], 6);
+  EXPECT_EQ(blocks[1][6], 21);
+  // Last column is replicated into padding
+  EXPECT_EQ(blocks[2][3], blocks[2][0]);
+}
+
+TEST(byte_blocks_test, nearest) {
+  ByteBlocks codeBook(7, 27);
+  for (size_t i = 0; i < codeBook.size(); i++)
+    for (size_t j = 0; j < codeBook.dim; j++)
+      codeBook[i][j] = (uint8_t)(i * 37 + j * 11);
+
+  ByteBlocks query(1, 27);
+  for (size_t j = 0; j < query.dim; j++)
+    query[0][j] = (uint8_t)(5 * 37 + j * 11 + 3);
+
+  uint32_t distance;
+  EXPECT_EQ(nearestBlock(query[0], codeBook, distance), 5u);
+  EXPECT_EQ(distance, 27u * 9);
+  EXPECT_EQ(squaredDistance(query[0], codeBook[5], query.stride), 27u * 9);
+}
+
+TEST(quantizer_test, byte_blocks) {
+  // Two well separated clusters have to end up in different cells
+  ByteBlocks trainingSet(64, 12);
+  for (size_t i = 0; i < trainingSet.size(); i++)
+    for (size_t j = 0; j < trainingSet.dim; j++)
+      trainingSet[i][j] = (uint8_t)((i % 2 ? 200 : 20) + i % 5);
+
+  std::vector<CharVector> codeVectors;
+  std::vector<size_t> assignedCodeVector;
+  VectorType distortion;
+  std::tie(codeVectors, assignedCodeVector, distortion) =
+      getQuantizer(Quantizers::LBG)->quantize(trainingSet, 1, 0.000001);
+
+  ASSERT_EQ(codeVectors.size(), 2u);
+  EXPECT_NE(assignedCodeVector[0], assignedCodeVector[1]);
+  for (size_t i = 2; i < trainingSet.size(); i++)
+    EXPECT_EQ(assignedCodeVector[i], assignedCodeVector[i % 2]);
+  EXPECT_LT(distortion, 4);
+}
+
+TEST(pca_search_test, matches_exhaustive_search) {
+  const size_t dim = 27;
+  std::vector<Vector> points(100, Vector(dim));
+  for (size_t i = 0; i < points.size(); i++)
+    for (size_t j = 0; j < dim; j++)
+      points[i][j] = (VectorType)((i * 7919 + j * 104729) % 256);
+
+  PCASearch search(dim, points);
+  for (size_t k = 0; k < 50; k++) {
+    Vector query(dim);
+    for (size_t j = 0; j < dim; j++)
+      query[j] = (VectorType)((k * 31 + j * j * 17) % 256);
+
+    VectorType best = squaredDistance(query, points[0]);
+    for (const auto &p : points)
+      best = std::min(best, squaredDistance(query, p));
+
+    VectorType distance;
+    size_t found = search.nearestNeighbour(query, k, distance);
+    EXPECT_DOUBLE_EQ(squaredDistance(query, points[found]), best);
+    EXPECT_DOUBLE_EQ(distance, best);
+  }
+}
+
+TEST(quantizer_test, principal_split_non_power_of_two) {
+  // Three clusters spread along different axes
+  std::vector<Vector> trainingSet;
+  for (size_t i = 0; i < 90; i++) {
+    Vector v(6, (VectorType)(i % 3) * 100);
+    v[i % 6] += (VectorType)(i % 7);
+    trainingSet.push_back(v);
+  }
+
+  QuantizerParameters parameters;
+  parameters.split = SplitMethods::PRINCIPAL;
+  parameters.codeVectors = 3;
+
+  std::vector<Vector> codeVectors;
+  std::vector<size_t> assignedCodeVector;
+  VectorType distortion;
+  std::tie(codeVectors, assignedCodeVector, distortion) =
+      getQuantizer(Quantizers::LBG, parameters)
+          ->quantize(trainingSet, 0, 0.000001);
+
+  ASSERT_EQ(codeVectors.size(), 3u);
+  std::set<size_t> used(std::begin(assignedCodeVector),
+                        std::end(assignedCodeVector));
+  EXPECT_EQ(used.size(), 3u);
+  for (size_t i = 3; i < trainingSet.size(); i++)
+    EXPECT_EQ(assignedCodeVector[i], assignedCodeVector[i % 3]);
+}
+
+TEST(quantizer_test, over_relaxation) {
+  // Four separated clusters, accelerated LBG has to find all of them
+  std::vector<Vector> trainingSet;
+  for (size_t i = 0; i < 400; i++) {
+    Vector v(3);
+    v[0] = (VectorType)((i % 2) * 100 + i % 11);
+    v[1] = (VectorType)((i / 2 % 2) * 100 + i % 13);
+    v[2] = (VectorType)(i % 17);
+    trainingSet.push_back(v);
+  }
+
+  VectorType plain, accelerated;
+  std::vector<Vector> codeVectors;
+  std::vector<size_t> assignedCodeVector;
+  std::tie(codeVectors, assignedCodeVector, plain) =
+      getQuantizer(Quantizers::LBG)->quantize(trainingSet, 2, 0.000001);
+
+  QuantizerParameters parameters;
+  parameters.acceleration = Accelerations::OVER_RELAXATION;
+  std::tie(codeVectors, assignedCodeVector, accelerated) =
+      getQuantizer(Quantizers::LBG, parameters)
+          ->quantize(trainingSet, 2, 0.000001);
+
+  ASSERT_EQ(codeVectors.size(), 4u);
+  for (size_t i = 4; i < trainingSet.size(); i++)
+    EXPECT_EQ(assignedCodeVector[i], assignedCodeVector[i % 4]);
+  EXPECT_NEAR(accelerated, plain, plain * 0.001);
+}
+
+TEST(quantizer_test, empty_cell_reseeding) {
+  // Clusters are symmetric around the mean, both children of scaling split
+  // are equally far from every block, so the second one starts empty
+  ByteBlocks trainingSet(40, 3);
+  for (size_t i = 0; i < trainingSet.size(); i++) {
+    trainingSet[i][0] = i % 2 ? 150 : 50;
+    trainingSet[i][1] = i % 2 ? 50 : 150;
+    trainingSet[i][2] = 100;
+  }
+
+  for (unsigned seed = 0; seed < 3; seed++) {
+    QuantizerParameters parameters;
+    parameters.seed = seed;
+
+    std::vector<CharVector> codeVectors;
+    std::vector<size_t> assignedCodeVector;
+    VectorType distortion;
+    std::tie(codeVectors, assignedCodeVector, distortion) =
+        getQuantizer(Quantizers::LBG, parameters)
+            ->quantize(trainingSet, 1, 0.000001);
+
+    EXPECT_NE(assignedCodeVector[0], assignedCodeVector[1]);
+    EXPECT_EQ(distortion, 0);
+  }
+}
+
+TEST(color_space_test, span_round_trip) {
+  std::vector<RGB> pixels;
+  for (int c = 0; c < MAX_COL; c++)
+    pixels.push_back({(char)c, (char)(MAX_COL - 1 - c), (char)(c * 7)});
+  for (auto space : {ColorSpaces::NORMAL, ColorSpaces::SCALED,
+                     ColorSpaces::CIE1931, ColorSpaces::YCBCR,
+                     ColorSpaces::LAB}) {
+    ColorSpacePtr cs = getColorSpace(space);
+    std::vector<VectorType> converted(pixels.size() * 3);
+    cs->RGBSpanToColorSpace(pixels.data(), pixels.size(), converted.data());
+    for (size_t i = 0; i < pixels.size(); i++) {
+      RGBDouble single = cs->RGBtoColorSpace(pixels[i]);
+      for (size_t k = 0; k < 3; k++)
+        EXPECT_NEAR(single[k], converted[i * 3 + k], 1e-9);
+    }
+    std::vector<RGB> back(pixels.size());
+    cs->colorSpaceSpanToRGB(converted.data(), back.size(), back.data());
+    EXPECT_EQ(back, pixels);
+  }
+  // Scaled space keeps 0-255 ordering of components
+  ColorSpacePtr scaled = getColorSpace(ColorSpaces::SCALED);
+  EXPECT_LT(scaled->RGBtoColorSpace({(char)127, 0, 0})[0],
+            scaled->RGBtoColorSpace({(char)128, 0, 0})[0]);
+}
+
+TEST(color_space_test, lab_reference_values) {
+  ColorSpacePtr lab = getColorSpace(ColorSpaces::LAB);
+  RGBDouble white = lab->RGBtoColorSpace({(char)255, (char)255, (char)255});
+  EXPECT_NEAR(white[0], 100, 1e-3);
+  EXPECT_NEAR(white[1], 0, 1e-2);
+  EXPECT_NEAR(white[2], 0, 1e-2);
+  RGBDouble red = lab->RGBtoColorSpace({(char)255, 0, 0});
+  EXPECT_NEAR(red[0], 53.24, 1e-2);
+  EXPECT_NEAR(red[1], 80.09, 1e-2);
+  EXPECT_NEAR(red[2], 67.20, 1e-2);
+}
+
+TEST(compressor_test, ycbcr420_round_trip) {
+  // Colour is constant over 2x2 squares, so subsampling loses nothing
+  RGBImage testImg;
+  testImg.xSize = 6;
+  testImg.ySize = 4;
+  for (int y = 0; y < 4; y++)
+    for (int x = 0; x < 6; x++) {
+      int square = (y / 2) * 3 + x / 2;
+      testImg.img.push_back(
+          {(char)(square * 40), (char)(250 - square * 30), (char)(square * 7)});
+    }
+
+  auto result = CompressedImage::compress(testImg, Quantizers::LBG,
+                                          ColorSpaces::YCBCR420, 2, 2, 0.001, 4);
+  CompressedImage &cImg = result.first;
+  EXPECT_EQ(cImg.assignedCodeVector.size(), 6u);
+  EXPECT_EQ(cImg.chromaAssignedCodeVector.size(), 2u);
+  EXPECT_EQ(cImg.codeVectors[0].size(), 4u);
+  EXPECT_EQ(cImg.chromaCodeVectors[0].size(), 8u);
+
+  RGBImage decompressed = CompressedImage::decompress(cImg);
+  for (size_t i = 0; i < testImg.img.size(); i++)
+    for (auto j : RGBRange)
+      EXPECT_NEAR((uint8_t)decompressed.img[i][j], (uint8_t)testImg.img[i][j],
+                  2);
+
+  const std::string path = "ycbcr420_round_trip.quant";
+  cImg.saveToFile(path);
+  CompressedImage loaded;
+  loaded.loadFromFile(path);
+  std::remove(path.c_str());
+  EXPECT_EQ(loaded.codeVectors, cImg.codeVectors);
+  EXPECT_EQ(loaded.chromaCodeVectors, cImg.chromaCodeVectors);
+  EXPECT_EQ(loaded.chromaAssignedCodeVector, cImg.chromaAssignedCodeVector);
+  EXPECT_EQ(CompressedImage::decompress(loaded).img, decompressed.img);
+}
+
+TEST(metrics_test, matches_full_decode) {
+  RGBImage testImg;
+  testImg.xSize = 150;
+  testImg.ySize = 140;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back(
+          {(char)(x * 3 + y), (char)(x * y / 40), (char)((x ^ y) * 5)});
+
+  // Every pixel is its own codevector, so image is reproduced exactly
+  CompressedImage exact;
+  exact.xSize = testImg.xSize;
+  exact.ySize = testImg.ySize;
+  exact.blockWidth = exact.blockHeight = 1;
+  exact.colorSpace = ColorSpaces::NORMAL;
+  for (size_t i = 0; i < testImg.img.size(); i++) {
+    exact.codeVectors.emplace_back(&testImg.img[i][0],
+                                   &testImg.img[i][0] + 3);
+    exact.assignedCodeVector.push_back(i);
+  }
+  QualityMetrics quality = measureQuality(testImg, exact);
+  EXPECT_EQ(quality.mse, 0);
+  EXPECT_NEAR(quality.ssim, 1, 1e-9);
+  EXPECT_NEAR(quality.msSsim, 1, 1e-9);
+
+  for (auto space : {ColorSpaces::NORMAL, ColorSpaces::YCBCR420}) {
+    auto result = CompressedImage::compress(testImg, Quantizers::LBG, space, 2,
+                                            3, 0.001, 3);
+    RGBImage decompressed = CompressedImage::decompress(result.first);
+    VectorType mse = 0;
+    for (size_t i = 0; i < testImg.img.size(); i++)
+      for (auto j : RGBRange)
+        mse += std::pow((VectorType)(uint8_t)testImg.img[i][j] -
+                            (VectorType)(uint8_t)decompressed.img[i][j],
+                        2);
+    mse /= testImg.img.size() * 3;
+
+    quality = measureQuality(testImg, result.first);
+    EXPECT_NEAR(quality.mse, mse, 1e-9);
+    EXPECT_NEAR(quality.psnr, 10 * std::log10(255 * 255 / mse), 1e-9);
+    EXPECT_GT(quality.ssim, 0);
+    EXPECT_LT(quality.ssim, 1);
+    EXPECT_GT(quality.msSsim, 0);
+    EXPECT_LT(quality.msSsim, 1);
+    EXPECT_EQ(result.second.distortion, quality.mse);
+    EXPECT_EQ(result.second.ssim, quality.ssim);
+  }
+}
+
+TEST(bit_packing_test, round_trip) {
+  for (unsigned bits : {0u, 1u, 3u, 7u, 8u, 10u, 13u, 24u}) {
+    for (size_t count : {0u, 1u, 5u, 17u, 1000u}) {
+      std::vector<size_t> values(count);
+      for (size_t i = 0; i < count; i++)
+        values[i] = bits ? (i * 2654435761u) & ((1u << bits) - 1) : 0;
+      auto packed = packBits(values, bits);
+      EXPECT_EQ(packed.size(), (count * bits + 7) / 8);
+      EXPECT_EQ(unpackBits(packed.data(), count, bits), values);
+    }
+  }
+  // Values go least significant bit first
+  auto packed = packBits({1, 2, 3}, 3);
+  ASSERT_EQ(packed.size(), 2u);
+  EXPECT_EQ(packed[0], 1 | 2 << 3 | (3 & 3) << 6);
+  EXPECT_EQ(packed[1], 0);
+}
+
+TEST(entropy_coding_test, rans_round_trip) {
+  std::mt19937 generator(7);
+  for (size_t alphabet : {1u, 2u, 256u, 1000u, 16384u}) {
+    // Skewed distribution, some symbols never show up
+    std::geometric_distribution<uint32_t> distribution(0.05);
+    std::vector<uint32_t> symbols(5003);
+    for (auto &s : symbols)
+      s = std::min<uint32_t>(distribution(generator), alphabet - 1);
+
+    std::vector<uint8_t> data = {42};
+    ransEncode(symbols, alphabet, data);
+    // Stays close to order-0 entropy, frequency table is small
+    std::map<uint32_t, size_t> counts;
+    for (auto s : symbols)
+      counts[s]++;
+    VectorType entropy = 0;
+    for (auto &c : counts)
+      entropy -= c.second * std::log2((VectorType)c.second / symbols.size());
+    EXPECT_LT(data.size(), entropy / 8 * 1.01 + 2 * counts.size() + 32);
+    ransEncode({}, alphabet, data);
+    size_t pos = 1;
+    EXPECT_EQ(ransDecode(data.data(), data.size(), pos, symbols.size(),
+                         alphabet),
+              symbols);
+    EXPECT_TRUE(ransDecode(data.data(), data.size(), pos, 0, alphabet).empty());
+    EXPECT_EQ(pos, data.size());
+  }
+}
+
+TEST(entropy_coding_test, corrupt_stream_throws) {
+  auto decode = [](const std::vector<uint8_t> &data, size_t alphabet) {
+    size_t pos = 0;
+    return ransDecode(data.data(), data.size(), pos, 10, alphabet);
+  };
+  size_t pos = 0;
+  const uint8_t unfinished[] = {0x80, 0x80};
+  EXPECT_THROW(readVarint(unfinished, sizeof(unfinished), pos),
+               std::runtime_error);
+
+  std::vector<uint8_t> valid;
+  ransEncode({0, 1, 2, 3, 3, 3, 2, 1, 0, 3}, 4, valid);
+  EXPECT_NO_THROW(decode(valid, 4));
+  EXPECT_THROW(decode(valid, RANS_MAX_ALPHABET + 1), std::runtime_error);
+  // Stream length runs past data
+  EXPECT_THROW(decode({valid.begin(), valid.end() - 1}, 4),
+               std::runtime_error);
+
+  std::vector<uint8_t> zeroRun;
+  writeVarint(0, zeroRun);
+  writeVarint(5, zeroRun);
+  EXPECT_THROW(decode(zeroRun, 4), std::runtime_error);
+  std::vector<uint8_t> overfull;
+  writeVarint(5000, overfull);
+  EXPECT_THROW(decode(overfull, 4), std::runtime_error);
+  std::vector<uint8_t> underfull;
+  for (int s = 0; s < 4; s++)
+    writeVarint(1, underfull);
+  EXPECT_THROW(decode(underfull, 4), std::runtime_error);
+}
+
+TEST(compressor_test, save_load_entropy_coded) {
+  RGBImage testImg;
+  testImg.xSize = 64;
+  testImg.ySize = 48;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back({(char)(x * 4), (char)(y * 5), (char)(x + y)});
+
+  for (auto space : {ColorSpaces::NORMAL, ColorSpaces::YCBCR420}) {
+    CompressedImage cImg = CompressedImage::compress(
+        testImg, Quantizers::LBG, space, 2, 2, 0.001, 6).first;
+    std::stringstream stream;
+    cImg.save(stream);
+
+    CompressedImage loaded;
+    loaded.load(stream);
+    EXPECT_EQ(loaded.codeVectors, cImg.codeVectors);
+    EXPECT_EQ(loaded.assignedCodeVector, cImg.assignedCodeVector);
+    EXPECT_EQ(loaded.chromaCodeVectors, cImg.chromaCodeVectors);
+    EXPECT_EQ(loaded.chromaAssignedCodeVector, cImg.chromaAssignedCodeVector);
+  }
+}
+
+TEST(quant_format_test, view_decodes_in_place) {
+  RGBImage testImg;
+  testImg.xSize = 61;
+  testImg.ySize = 35;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back({(char)(x * 4), (char)(y * 7), (char)(x ^ y)});
+
+  for (auto space : {ColorSpaces::NORMAL, ColorSpaces::YCBCR420}) {
+    CompressedImage cImg = CompressedImage::compress(
+        testImg, Quantizers::LBG, space, 3, 2, 0.001, 5).first;
+    std::ostringstream stream;
+    cImg.save(stream);
+    const std::string file = stream.str();
+    EXPECT_EQ(file.size() % QUANT_ALIGNMENT, 0u);
+
+    QuantView view(reinterpret_cast<const uint8_t *>(file.data()),
+                   file.size());
+    ASSERT_EQ(view.sections(), space == ColorSpaces::YCBCR420 ? 2u : 1u);
+    for (size_t i = 0; i < view.sections(); i++) {
+      EXPECT_EQ(view.section(i).codebookOffset % QUANT_ALIGNMENT, 0u);
+      EXPECT_EQ(view.section(i).indexOffset % QUANT_ALIGNMENT, 0u);
+    }
+    EXPECT_EQ(view.decompress().img, CompressedImage::decompress(cImg).img);
+
+    std::string broken = file;
+    broken[0] = 'X';
+    EXPECT_THROW(QuantView(reinterpret_cast<const uint8_t *>(broken.data()),
+                           broken.size()),
+                 std::runtime_error);
+    EXPECT_THROW(QuantView(reinterpret_cast<const uint8_t *>(file.data()),
+                           file.size() / 2),
+                 std::runtime_error);
+  }
+}
+
+TEST(quant_format_test, region_matches_full_decode) {
+  // Bigger than one tile, so regions cross tile borders
+  RGBImage testImg;
+  testImg.xSize = 301;
+  testImg.ySize = 203;
+  std::mt19937 generator(5);
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back({(char)(x + (int)(generator() % 16)),
+                             (char)(y * 3), (char)(x * y / 64)});
+
+  for (auto space : {ColorSpaces::NORMAL, ColorSpaces::YCBCR420}) {
+    CompressedImage cImg = CompressedImage::compress(
+        testImg, Quantizers::LBG, space, 3, 2, 0.001, 6).first;
+    std::ostringstream stream;
+    cImg.save(stream);
+    const std::string file = stream.str();
+    QuantView view(reinterpret_cast<const uint8_t *>(file.data()),
+                   file.size());
+    EXPECT_NE((IndexCoding)view.section(0).indexCoding, IndexCoding::PACKED);
+    const RGBImage full = view.decompress();
+    ASSERT_EQ(full.img, CompressedImage::decompress(cImg).img);
+
+    for (int k = 0; k < 20; k++) {
+      const size_t x = generator() % testImg.xSize;
+      const size_t y = generator() % testImg.ySize;
+      const size_t w = 1 + generator() % (testImg.xSize - x);
+      const size_t h = 1 + generator() % (testImg.ySize - y);
+      const RGBImage region = view.decompressRegion(x, y, w, h);
+      std::vector<RGB> inMemory(w * h);
+      cImg.decompressRegion(x, y, w, h, inMemory.data());
+      ASSERT_EQ(region.xSize, (int)w);
+      ASSERT_EQ(region.ySize, (int)h);
+      EXPECT_EQ(region.img, inMemory);
+      for (size_t j = 0; j < h; j++)
+        for (size_t i = 0; i < w; i++)
+          ASSERT_EQ(region.img[j * w + i],
+                    full.img[(y + j) * testImg.xSize + x + i]);
+    }
+    EXPECT_THROW(view.decompressRegion(300, 0, 2, 1), std::out_of_range);
+  }
+}
+
+TEST(quant_format_test, corrupt_tile_throws) {
+  RGBImage testImg;
+  testImg.xSize = 400;
+  testImg.ySize = 300;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back({(char)(x * 3), (char)(y ^ x), (char)(y * 2)});
+  CompressedImage cImg = CompressedImage::compress(
+      testImg, Quantizers::LBG, ColorSpaces::NORMAL, 2, 2, 0.001, 6).first;
+  std::ostringstream stream;
+  cImg.save(stream);
+  std::string file = stream.str();
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(file.data());
+  const SectionHeader section = QuantView(data, file.size()).section(0);
+  ASSERT_NE((IndexCoding)section.indexCoding, IndexCoding::PACKED);
+
+  // Tiles are decoded in parallel, error of one of them has to reach caller
+  const uint64_t broken = section.indexSize + 1;
+  std::memcpy(&file[section.indexOffset + 3 * sizeof(uint64_t)], &broken,
+              sizeof(broken));
+  QuantView view(data, file.size());
+  EXPECT_THROW(view.decompress(), std::runtime_error);
+  EXPECT_NO_THROW(view.decompressRegion(0, 0, 10, 10));
+}
+
+TEST(quant_format_test, corrupt_payload_throws) {
+  RGBImage testImg;
+  testImg.xSize = 200;
+  testImg.ySize = 150;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back({(char)(x / 4), (char)(y / 4), (char)(x / 8)});
+  CompressedImage cImg = CompressedImage::compress(
+      testImg, Quantizers::LBG, ColorSpaces::NORMAL, 2, 2, 0.001, 6).first;
+  std::ostringstream stream;
+  cImg.save(stream);
+  const std::string file = stream.str();
+  auto decode = [](std::string corrupted) {
+    QuantView(reinterpret_cast<const uint8_t *>(corrupted.data()),
+              corrupted.size())
+        .decompress();
+  };
+  EXPECT_NO_THROW(decode(file));
+  const SectionHeader section =
+      QuantView(reinterpret_cast<const uint8_t *>(file.data()), file.size())
+          .section(0);
+  ASSERT_EQ((CodebookCoding)section.codebookCoding,
+            CodebookCoding::DELTA_RANS);
+  ASSERT_NE((IndexCoding)section.indexCoding, IndexCoding::PACKED);
+
+  // Huge varint: frequency of rANS table, or stream length of context
+  // coded tile
+  const std::string huge = "\xff\xff\xff\xff\x0f";
+  std::string corrupted = file;
+  corrupted.replace(section.codebookOffset, 3, "\xff\xff\x3f");
+  EXPECT_THROW(decode(corrupted), std::runtime_error);
+  corrupted = file;
+  uint64_t firstTile;
+  std::memcpy(&firstTile, &file[section.indexOffset], sizeof(firstTile));
+  corrupted.replace(section.indexOffset + firstTile, huge.size(), huge);
+  EXPECT_THROW(decode(corrupted), std::runtime_error);
+
+  // Headers whose sizes would overflow or break coder limits
+  auto patched = [](std::string res, size_t offset, uint64_t value,
+                    size_t bytes) {
+    std::memcpy(&res[offset], &value, bytes);
+    return res;
+  };
+  const size_t sectionStart = sizeof(QuantHeader);
+  EXPECT_THROW(decode(patched(file, offsetof(QuantHeader, xSize),
+                              (uint64_t)1 << 40, sizeof(uint64_t))),
+               std::runtime_error);
+  EXPECT_THROW(decode(patched(file, offsetof(QuantHeader, blockWidth),
+                              UINT32_MAX, sizeof(uint32_t))),
+               std::runtime_error);
+  EXPECT_THROW(decode(patched(file,
+                              sectionStart + offsetof(SectionHeader, tileWidth),
+                              UINT32_MAX, sizeof(uint32_t))),
+               std::runtime_error);
+  // Counts far past format limits, index width is never computed for them
+  EXPECT_THROW(decode(patched(file,
+                              sectionStart + offsetof(SectionHeader, codeVectors),
+                              (uint64_t)1 << 63, sizeof(uint64_t))),
+               std::runtime_error);
+  EXPECT_THROW(decode(patched(file,
+                              sectionStart + offsetof(SectionHeader, indexSize),
+                              UINT64_MAX - 3, sizeof(uint64_t))),
+               std::runtime_error);
+  const std::string rans =
+      patched(patched(file, sectionStart + offsetof(SectionHeader, indexCoding),
+                      (uint32_t)IndexCoding::RANS, sizeof(uint32_t)),
+              sectionStart + offsetof(SectionHeader, codeVectors),
+              RANS_MAX_ALPHABET + 1, sizeof(uint64_t));
+  EXPECT_THROW(decode(rans), std::runtime_error);
+}
+
+TEST(quant_format_test, progressive_prefix_decodes) {
+  RGBImage testImg;
+  testImg.xSize = 96;
+  testImg.ySize = 64;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back(
+          {(char)(x * 2), (char)(y * 4), (char)((x / 8 + y / 8) * 20)});
+
+  CompressionParameters parameters;
+  parameters.progressive = true;
+  for (auto space : {ColorSpaces::NORMAL, ColorSpaces::YCBCR420}) {
+    CompressedImage cImg = CompressedImage::compress(
+        testImg, Quantizers::LBG, space, 2, 2, 0.001, 6, parameters).first;
+    std::ostringstream stream;
+    cImg.save(stream);
+    const std::string file = stream.str();
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(file.data());
+    const RGBImage full = CompressedImage::decompress(cImg);
+    QuantView view(data, file.size());
+    EXPECT_EQ(view.decompress().img, full.img);
+
+    // Distortion against full decode falls as more planes arrive
+    uint64_t planesBegin = 0;
+    for (size_t i = 0; i < view.sections(); i++)
+      planesBegin = std::max(planesBegin, view.section(i).indexOffset +
+                                              view.section(i).indexSize);
+    planesBegin = (planesBegin + sizeof(uint64_t) + QUANT_ALIGNMENT - 1) /
+                  QUANT_ALIGNMENT * QUANT_ALIGNMENT;
+    double previous = INFINITY;
+    size_t previousPlanes = 0;
+    for (size_t part = 0; part <= 4; part++) {
+      QuantView prefix(data,
+                       planesBegin + (file.size() - planesBegin) * part / 4);
+      EXPECT_GE(prefix.planes(0), previousPlanes);
+      previousPlanes = prefix.planes(0);
+      const RGBImage preview = prefix.decompress();
+      double error = 0;
+      for (size_t k = 0; k < full.img.size(); k++)
+        for (int c = 0; c < 3; c++) {
+          double d = (uint8_t)preview.img[k][c] - (uint8_t)full.img[k][c];
+          error += d * d;
+        }
+      EXPECT_LE(error, previous * 1.05);
+      previous = error;
+    }
+    EXPECT_EQ(previousPlanes, bitsPerIndex(cImg.codeVectors.size()));
+    EXPECT_EQ(previous, 0);
+  }
+}
+
+TEST(compressor_test, rate_points_match_single_runs) {
+  RGBImage testImg;
+  testImg.xSize = 48;
+  testImg.ySize = 40;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back({(char)(x * 5), (char)(y * 6), (char)(x * y)});
+
+  for (auto space : {ColorSpaces::NORMAL, ColorSpaces::YCBCR420}) {
+    auto points = CompressedImage::compressRatePoints(
+        testImg, Quantizers::LBG, space, 2, 2, 0.001, {2, 4, 5});
+    ASSERT_EQ(points.size(), 3u);
+    for (const auto &point : points) {
+      const size_t level = bitsPerIndex(point.first.codeVectors.size());
+      auto single = CompressedImage::compress(testImg, Quantizers::LBG, space,
+                                              2, 2, 0.001, level);
+      EXPECT_EQ(point.first.codeVectors, single.first.codeVectors);
+      EXPECT_EQ(point.first.assignedCodeVector,
+                single.first.assignedCodeVector);
+      EXPECT_EQ(point.first.chromaCodeVectors,
+                single.first.chromaCodeVectors);
+      EXPECT_EQ(point.second.bitsPerPixel, single.second.bitsPerPixel);
+    }
+    EXPECT_EQ(points[0].first.codeVectors.size(), 4u);
+    EXPECT_LT(points[0].second.psnr, points[2].second.psnr);
+
+    // Targets pick the first level reaching PSNR, the last one in budget
+    CompressionParameters parameters;
+    parameters.targetPsnr = (points[0].second.psnr + points[1].second.psnr) / 2;
+    auto picked = CompressedImage::compressRatePoints(
+        testImg, Quantizers::LBG, space, 2, 2, 0.001, {2, 4, 5}, parameters);
+    ASSERT_EQ(picked.size(), 1u);
+    EXPECT_EQ(picked[0].first.codeVectors, points[1].first.codeVectors);
+
+    parameters.targetPsnr = 0;
+    parameters.targetBitsPerPixel =
+        (points[1].second.bitsPerPixel + points[2].second.bitsPerPixel) / 2;
+    picked = CompressedImage::compressRatePoints(
+        testImg, Quantizers::LBG, space, 2, 2, 0.001, {2, 4, 5}, parameters);
+    ASSERT_EQ(picked.size(), 1u);
+    EXPECT_EQ(picked[0].first.codeVectors, points[1].first.codeVectors);
+  }
+}
+
+TEST(batch_test, matches_single_runs) {
+  // Images of different sizes, so they finish out of order
+  std::vector<BatchJob> jobs;
+  std::vector<RGBImage> images;
+  for (int k = 0; k < 5; k++) {
+    RGBImage image;
+    image.xSize = 16 + k * 23;
+    image.ySize = 12 + k * 11;
+    for (int y = 0; y < image.ySize; y++)
+      for (int x = 0; x < image.xSize; x++)
+        image.img.push_back({(char)(x * 7 + k), (char)(y * 5), (char)(x ^ y)});
+    const std::string name = "batch_test_" + std::to_string(k);
+    image.saveToFile(name + ".ppm");
+    jobs.push_back({name + ".ppm", name + ".quant"});
+    images.push_back(image);
+  }
+
+  BatchSettings settings;
+  settings.colorSpace = ColorSpaces::NORMAL;
+  settings.n = 4;
+  settings.threads = 3;
+  std::set<std::string> done;
+  compressBatch(jobs, settings, [&](const BatchResult &result) {
+    EXPECT_TRUE(result.error.empty());
+    EXPECT_GT(result.raport.psnr, 20);
+    done.insert(result.job.output);
+  });
+  EXPECT_EQ(done.size(), jobs.size());
+
+  for (size_t k = 0; k < jobs.size(); k++) {
+    auto single = CompressedImage::compress(images[k], Quantizers::LBG,
+                                            ColorSpaces::NORMAL, 2, 2,
+                                            settings.eps, settings.n);
+    CompressedImage loaded;
+    loaded.loadFromFile(jobs[k].output);
+    EXPECT_EQ(loaded.codeVectors, single.first.codeVectors);
+    EXPECT_EQ(loaded.assignedCodeVector, single.first.assignedCodeVector);
+    std::remove(jobs[k].input.c_str());
+    std::remove(jobs[k].output.c_str());
+  }
+}
+
+TEST(batch_test, unwritable_output_reported) {
+  RGBImage image;
+  image.xSize = 8;
+  image.ySize = 6;
+  for (int i = 0; i < image.xSize * image.ySize; i++)
+    image.img.push_back({(char)(i * 5), (char)(i * 3), (char)i});
+  image.saveToFile("batch_test_unwritable.ppm");
+
+  // Both .quant and image outputs go to a directory that does not exist
+  const std::vector<BatchJob> jobs = {
+      {"batch_test_unwritable.ppm", "batch_test_missing/out.quant"},
+      {"batch_test_unwritable.ppm", "batch_test_missing/out.ppm"}};
+  BatchSettings settings;
+  settings.n = 2;
+  size_t failed = 0;
+  compressBatch(jobs, settings, [&](const BatchResult &result) {
+    EXPECT_FALSE(result.error.empty()) << result.job.output;
+    failed++;
+  });
+  EXPECT_EQ(failed, jobs.size());
+  std::remove("batch_test_unwritable.ppm");
+}
+
+TEST(c_api_test, strided_buffers_match_cpp_api) {
+  RGBImage testImg;
+  testImg.xSize = 37;
+  testImg.ySize = 29;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back({(char)(x * 5), (char)(y * 9), (char)(x + y)});
+
+  // Rows padded with garbage, which must be neither read nor written
+  const size_t stride = testImg.xSize * 3 + 13;
+  std::vector<uint8_t> pixels(stride * testImg.ySize, 0xAB);
+  for (int y = 0; y < testImg.ySize; y++)
+    std::memcpy(&pixels[y * stride], &testImg.img[y * testImg.xSize],
+                testImg.xSize * 3);
+
+  for (auto space : {QUANT_NORMAL, QUANT_YCBCR, QUANT_YCBCR420}) {
+    quant_options options;
+    quant_default_options(&options);
+    options.color_space = space;
+    options.bits = 5;
+    uint8_t *data = nullptr;
+    size_t size = 0;
+    quant_stats stats;
+    ASSERT_EQ(quant_compress(pixels.data(), testImg.xSize, testImg.ySize,
+                             stride, &options, &data, &size, &stats),
+              QUANT_OK);
+    auto single = CompressedImage::compress(
+        testImg, Quantizers::LBG, (ColorSpaces)space, 2, 2, options.eps, 5);
+    EXPECT_FLOAT_EQ(stats.psnr, single.second.psnr);
+
+    quant_info info;
+    ASSERT_EQ(quant_get_info(data, size, &info), QUANT_OK);
+    EXPECT_EQ(info.width, (uint32_t)testImg.xSize);
+    EXPECT_EQ(info.height, (uint32_t)testImg.ySize);
+    EXPECT_EQ(info.color_space, space);
+
+    std::vector<uint8_t> out(stride * testImg.ySize, 0xCD);
+    ASSERT_EQ(quant_decompress(data, size, out.data(), stride), QUANT_OK);
+    const RGBImage expected = CompressedImage::decompress(single.first);
+    for (int y = 0; y < testImg.ySize; y++) {
+      EXPECT_EQ(std::memcmp(&out[y * stride], &expected.img[y * testImg.xSize],
+                            testImg.xSize * 3),
+                0);
+      for (size_t x = testImg.xSize * 3; x < stride; x++)
+        ASSERT_EQ(out[y * stride + x], 0xCD);
+    }
+
+    std::vector<uint8_t> region(5 * 3 * 4);
+    ASSERT_EQ(quant_decompress_region(data, size, 3, 7, 4, 5, region.data(),
+                                      4 * 3),
+              QUANT_OK);
+    for (int y = 0; y < 5; y++)
+      EXPECT_EQ(std::memcmp(&region[y * 12], &out[(7 + y) * stride + 9], 12),
+                0);
+    EXPECT_EQ(quant_decompress_region(data, size, 36, 0, 2, 1, region.data(),
+                                      6),
+              QUANT_INVALID_ARGUMENT);
+    EXPECT_EQ(quant_decompress(data, size / 2, out.data(), stride),
+              QUANT_CORRUPT_DATA);
+    quant_free(data);
+  }
+  quant_options options;
+  quant_default_options(&options);
+  uint8_t *data = nullptr;
+  size_t size = 0;
+  EXPECT_EQ(quant_compress(pixels.data(), testImg.xSize, testImg.ySize, 10,
+                           &options, &data, &size, nullptr),
+            QUANT_INVALID_ARGUMENT);
+  // Options beyond format limits are refused before training starts
+  auto compress = [&](const quant_options &o) {
+    return quant_compress(pixels.data(), testImg.xSize, testImg.ySize, stride,
+                          &o, &data, &size, nullptr);
+  };
+  quant_options tooMany = options;
+  tooMany.code_vectors = (uint64_t)1 << 40;
+  EXPECT_EQ(compress(tooMany), QUANT_INVALID_ARGUMENT);
+  quant_options tooWide = options;
+  tooWide.block_width = 1u << 31;
+  EXPECT_EQ(compress(tooWide), QUANT_INVALID_ARGUMENT);
+  quant_options tooTall = options;
+  tooTall.block_height = 257;
+  EXPECT_EQ(compress(tooTall), QUANT_INVALID_ARGUMENT);
+}
+
+TEST(c_api_test, corrupt_data_reported) {
+  std::vector<uint8_t> pixels;
+  for (int y = 0; y < 60; y++)
+    for (int x = 0; x < 80; x++)
+      pixels.insert(std::end(pixels), {(uint8_t)(x / 4), (uint8_t)(y / 4),
+                                       (uint8_t)(x / 8)});
+  quant_options options;
+  quant_default_options(&options);
+  options.color_space = QUANT_NORMAL;
+  options.bits = 6;
+  uint8_t *data = nullptr;
+  size_t size = 0;
+  ASSERT_EQ(quant_compress(pixels.data(), 80, 60, 80 * 3, &options, &data,
+                           &size, nullptr),
+            QUANT_OK);
+  const std::vector<uint8_t> file(data, data + size);
+  quant_free(data);
+  const SectionHeader section = QuantView(file.data(), file.size()).section(0);
+  ASSERT_EQ((CodebookCoding)section.codebookCoding,
+            CodebookCoding::DELTA_RANS);
+
+  std::vector<uint8_t> out(pixels.size());
+  auto status = [&](size_t offset, std::vector<uint8_t> bytes) {
+    std::vector<uint8_t> corrupted = file;
+    std::copy(std::begin(bytes), std::end(bytes), &corrupted[offset]);
+    return quant_decompress(corrupted.data(), corrupted.size(), out.data(),
+                            80 * 3);
+  };
+  EXPECT_EQ(status(0, {}), QUANT_OK);
+  // Frequency table of codebook
+  EXPECT_EQ(status(section.codebookOffset, {0xff, 0xff, 0x3f}),
+            QUANT_CORRUPT_DATA);
+  // Width beyond 32 bits of quant_info
+  quant_info info;
+  EXPECT_EQ(quant_get_info(file.data(), file.size(), &info), QUANT_OK);
+  std::vector<uint8_t> wide = file;
+  wide[offsetof(QuantHeader, xSize) + 4] = 1;
+  EXPECT_EQ(quant_get_info(wide.data(), wide.size(), &info),
+            QUANT_CORRUPT_DATA);
+}
+
+// Decodes Netpbm file kept in a string
+static std::vector<RGB> decodeNetpbm(const std::string &file) {
+  NetpbmImage image(reinterpret_cast<const uint8_t *>(file.data()),
+                    file.size());
+  const RGBView &view = image.view();
+  std::vector<RGB> res;
+  for (size_t y = 0; y < view.ySize; y++)
+    res.insert(std::end(res), view.row(y), view.row(y) + view.xSize);
+  return res;
+}
+
+TEST(netpbm_test, formats_decode_alike) {
+  const int w = 5, h = 3;
+  std::vector<RGB> rgb, gray, bits;
+  std::string p3 = "P3\n# comment\n5 3\n255\n", p6 = "P6 5 3 255\n",
+              wide = "P6\n5 3\n65535\n", pam = "P7\nWIDTH 5\nHEIGHT 3\n"
+                                               "DEPTH 4\nMAXVAL 255\n"
+                                               "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+              p2 = "P2\n5 3 15\n", p5 = "P5\n5 3\n15\n", p1 = "P1\n5 3\n",
+              p4 = "P4\n5 3\n";
+  for (int y = 0; y < h; y++) {
+    uint8_t row = 0;
+    for (int x = 0; x < w; x++) {
+      const uint8_t c[3] = {(uint8_t)(x * 50), (uint8_t)(y * 100),
+                            (uint8_t)(x * y + 7)};
+      rgb.push_back({(char)c[0], (char)c[1], (char)c[2]});
+      for (int k = 0; k < 3; k++) {
+        p3 += std::to_string(c[k]) + " ";
+        p6 += (char)c[k];
+        wide += (char)c[k];
+        wide += (char)c[k];
+        pam += (char)c[k];
+      }
+      pam += (char)0x80;
+
+      const uint8_t v = (uint8_t)((x + y * w) % 16);
+      const char scaled = (char)(v * 17);
+      gray.push_back({scaled, scaled, scaled});
+      p2 += std::to_string(v) + " ";
+      p5 += (char)v;
+
+      const bool black = (x + y) % 2;
+      const char bit = black ? 0 : (char)255;
+      bits.push_back({bit, bit, bit});
+      p1 += black ? '1' : '0';
+      row |= black << (7 - x);
+    }
+    p4 += (char)row;
+  }
+
+  EXPECT_EQ(decodeNetpbm(p3), rgb);
+  EXPECT_EQ(decodeNetpbm(p6), rgb);
+  EXPECT_EQ(decodeNetpbm(wide), rgb);
+  EXPECT_EQ(decodeNetpbm(pam), rgb);
+  EXPECT_EQ(decodeNetpbm(p2), gray);
+  EXPECT_EQ(decodeNetpbm(p5), gray);
+  EXPECT_EQ(decodeNetpbm(p1), bits);
+  EXPECT_EQ(decodeNetpbm(p4), bits);
+  EXPECT_TRUE(NetpbmImage(reinterpret_cast<const uint8_t *>(p6.data()),
+                          p6.size())
+                  .inPlace());
+
+  // Written with padded rows and read back
+  const size_t stride = w * 3 + 2;
+  std::vector<char> padded(stride * h);
+  for (int y = 0; y < h; y++)
+    std::memcpy(&padded[y * stride], &rgb[y * w], w * 3);
+  RGBView view(reinterpret_cast<const RGB *>(padded.data()), w, h, stride);
+  for (auto format : {NetpbmFormat::PPM, NetpbmFormat::PAM}) {
+    std::ostringstream stream;
+    writeNetpbm(view, stream, format);
+    EXPECT_EQ(decodeNetpbm(stream.str()), rgb);
+  }
+
+  for (const std::string &bad :
+       {std::string("P9\n1 1 255\n"), std::string("P6\n5 3 255\n") + "abc",
+        std::string("P2\n1 1 15\n16"), std::string("P6\n0 3 255\n"),
+        std::string("P5\n1 1 70000\n  "),
+        std::string("P7\nWIDTH 1\nHEIGHT 1\nDEPTH 2\nMAXVAL 255\n"
+                    "TUPLTYPE RGB\nENDHDR\n  ")})
+    EXPECT_THROW(decodeNetpbm(bad), std::runtime_error) << bad;
+}
+
+TEST(image_io_test, png_and_qoi_round_trip) {
+  // Flat runs longer than QOI run limit, small steps, gradients and noise,
+  // so every QOI chunk type appears
+  RGBImage testImg;
+  testImg.xSize = 150;
+  testImg.ySize = 40;
+  std::mt19937 generator(3);
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++) {
+      if (y < 10)
+        testImg.img.push_back({10, 20, 30});
+      else if (y < 20)
+        testImg.img.push_back({(char)(x / 2), (char)(x / 3), (char)(y + x)});
+      else if (y < 30)
+        testImg.img.push_back({(char)(x * 9), (char)(x * 7), (char)(x * 8)});
+      else
+        testImg.img.push_back({(char)generator(), (char)generator(),
+                               (char)(generator() % 4)});
+    }
+
+  // Padded rows, stride not divisible by pixel size
+  const size_t stride = testImg.xSize * 3 + 1;
+  std::vector<char> padded(stride * testImg.ySize);
+  for (int y = 0; y < testImg.ySize; y++)
+    std::memcpy(&padded[y * stride], &testImg.img[y * testImg.xSize],
+                testImg.xSize * 3);
+  RGBView view(reinterpret_cast<const RGB *>(padded.data()), testImg.xSize,
+               testImg.ySize, stride);
+
+  typedef RGBImage (*Reader)(const uint8_t *, size_t);
+  typedef void (*Writer)(const RGBView &, std::ostream &);
+  const std::pair<Reader, Writer> codecs[] = {{readPng, writePng},
+                                              {readQoi, writeQoi}};
+  for (const auto &codec : codecs) {
+    for (const RGBView &source : {RGBView(testImg), view}) {
+      std::ostringstream stream;
+      codec.second(source, stream);
+      const std::string file = stream.str();
+      EXPECT_LT(file.size(), testImg.sizeInBytes());
+      const RGBImage decoded = codec.first(
+          reinterpret_cast<const uint8_t *>(file.data()), file.size());
+      EXPECT_EQ(decoded.xSize, testImg.xSize);
+      EXPECT_EQ(decoded.ySize, testImg.ySize);
+      EXPECT_EQ(decoded.img, testImg.img);
+
+      const std::string truncated = file.substr(0, file.size() / 2);
+      EXPECT_THROW(
+          codec.first(reinterpret_cast<const uint8_t *>(truncated.data()),
+                      truncated.size()),
+          std::runtime_error);
+    }
+  }
+}
+
+TEST(image_io_test, stream_matches_memory) {
+  // Raster spans several read chunks
+  RGBImage testImg;
+  testImg.xSize = 301;
+  testImg.ySize = 250;
+  for (int y = 0; y < testImg.ySize; y++)
+    for (int x = 0; x < testImg.xSize; x++)
+      testImg.img.push_back({(char)(x * 3), (char)(y + x), (char)(x ^ y)});
+
+  for (const std::string path : {".ppm", ".pam", ".png", ".qoi"}) {
+    std::ostringstream encoded;
+    writeImage(testImg, encoded, path);
+    std::istringstream stream(encoded.str() + "trailing");
+    EXPECT_EQ(readImage(stream, path).img, testImg.img) << path;
+  }
+
+  // Plain and 16 bit rasters, header with comments
+  std::string plain = "P3\n# first\n2 2\n# second\n15\n", wide = "P6 2 2 65535\n";
+  std::vector<RGB> expected;
+  for (int i = 0; i < 4; i++) {
+    for (int k = 0; k < 3; k++) {
+      plain += std::to_string(i * 4 + k) + "\n";
+      wide += (char)(i * 60 + k);
+      wide += (char)0;
+    }
+    expected.push_back({(char)((i * 4) * 17), (char)((i * 4 + 1) * 17),
+                        (char)((i * 4 + 2) * 17)});
+  }
+  std::istringstream plainStream(plain);
+  EXPECT_EQ(readNetpbm(plainStream).img, expected);
+  std::istringstream wideStream(wide);
+  const RGBImage decoded = readNetpbm(wideStream);
+  for (int i = 0; i < 4; i++)
+    EXPECT_EQ((uint8_t)decoded.img[i][0],
+              (uint8_t)std::round((i * 60 * 256) * 255.0 / 65535));
+
+  std::istringstream truncated("P6\n4 4 255\nabc");
+  EXPECT_THROW(readNetpbm(truncated), std::runtime_error);
+}
+
+TEST(context_coding_test, round_trip) {
+  std::mt19937 generator(3);
+  for (size_t alphabet : {1u, 2u, 300u, 70000u}) {
+    // Runs of repeated indices with some random ones, like flat areas
+    const size_t width = 37;
+    std::vector<size_t> indices(width * 29);
+    for (size_t k = 0; k < indices.size(); k++) {
+      if (generator() % 4 == 0 || k == 0)
+        indices[k] = generator() % alphabet;
+      else if (k >= width && generator() % 2)
+        indices[k] = indices[k - width];
+      else
+        indices[k] = indices[k - 1];
+    }
+
+    std::vector<uint8_t> data = {1, 2};
+    encodeIndexGrid(indices, width, alphabet, data);
+    size_t pos = 2;
+    EXPECT_EQ(decodeIndexGrid(data.data(), data.size(), pos, indices.size(),
+                              width, alphabet),
+              indices);
+    EXPECT_EQ(pos, data.size());
+    pos = 2;
+    EXPECT_THROW(decodeIndexGrid(data.data(), data.size() - 1, pos,
+                                 indices.size(), width, alphabet),
+                 std::runtime_error);
+    // Repeats are cheap
+    if (alphabet == 300) {
+      EXPECT_LT(data.size(), packedSize(indices.size(), 9) / 2);
+    }
+  }
+}
+
+TEST(compressor_test, reorder_code_vectors) {
+  std::vector<CharVector> codeVectors = {
+      {(char)200, 0, 0}, {10, 10, 10}, {(char)190, 5, 0}, {20, 10, 10}};
+  std::vector<size_t> assigned = {0, 1, 2, 3, 3, 0};
+  std::vector<CharVector> original = codeVectors;
+  std::vector<size_t> originalAssigned = assigned;
+
+  reorderCodeVectors(codeVectors, assigned);
+  std::vector<CharVector> expected = {
+      {10, 10, 10}, {20, 10, 10}, {(char)190, 5, 0}, {(char)200, 0, 0}};
+  EXPECT_EQ(codeVectors, expected);
+  for (size_t i = 0; i < assigned.size(); i++)
+    EXPECT_EQ(codeVectors[assigned[i]], original[originalAssigned[i]]);
+
+  // Big codebook is ordered by brightness
+  std::mt19937 generator(5);
+  std::vector<CharVector> big(5000, CharVector(3));
+  for (auto &c : big)
+    for (auto &x : c)
+      x = (char)generator();
+  std::vector<size_t> bigAssigned = {0, 4999, 1234};
+  const std::vector<CharVector> bigOriginal = big;
+  reorderCodeVectors(big, bigAssigned);
+  auto brightness = [](const CharVector &c) {
+    return (uint8_t)c[0] + (uint8_t)c[1] + (uint8_t)c[2];
+  };
+  for (size_t k = 1; k < big.size(); k++)
+    EXPECT_LE(brightness(big[k - 1]), brightness(big[k]));
+  EXPECT_EQ(big[bigAssigned[1]], bigOriginal[4999]);
+}